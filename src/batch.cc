@@ -0,0 +1,187 @@
+#include <string.h>
+#include <iostream>
+
+#include <lz4.h>
+#include "env.h"
+#include "wrapper.h"
+#include "batch.h"
+
+using namespace std;
+
+/* Marker value under key 0: "batch/<version>[+<codec>][+ts]", version 2 tags the lengths for blobs. */
+static const char markerPrefix[] = "batch/";
+
+size_t BatchRecord::varintSize(uint64_t v) {
+    size_t ret = 1;
+    while (v >= 0x80) {
+        v >>= 7;
+        ++ret;
+    }
+    return ret;
+}
+
+char* BatchRecord::putVarint(char* dst, uint64_t v) {
+    while (v >= 0x80) {
+        *dst++ = char(v | 0x80);
+        v >>= 7;
+    }
+    *dst++ = char(v);
+    return dst;
+}
+
+const char* BatchRecord::getVarint(const char* src, const char* end, uint64_t& v) {
+    v = 0;
+    for (int shift = 0; src < end && shift < 64; shift += 7) {
+        uint8_t b = uint8_t(*src++);
+        v |= uint64_t(b & 0x7f) << shift;
+        if (!(b & 0x80)) return src;
+    }
+    return nullptr;
+}
+
+ChunkFormat BatchRecord::format(MDB_txn* txn, MDB_dbi db) {
+    ChunkFormat ret = { false, COMPRESSION_NONE, false, false };
+
+    uint64_t markerKey = MARKER_KEY;
+    MDB_val key{ sizeof(markerKey), &markerKey }, val;
+    if (mdb_get(txn, db, &key, &val) == 0) {
+        string marker((const char*)val.mv_data, val.mv_size);
+        ret.batched = true;
+        ret.blobs = marker.compare(0, strlen(markerPrefix) + 1, string(markerPrefix) + "2") == 0;
+        if (marker.find("+lz4") != string::npos) ret.codec = COMPRESSION_LZ4;
+        ret.timed = marker.find("+ts") != string::npos;
+    }
+    return ret;
+}
+
+int BatchRecord::mark(MDB_txn* txn, MDB_dbi db, const ChunkFormat& format) {
+    string marker = string(markerPrefix) + (format.blobs ? "2" : "1") + (format.codec == COMPRESSION_LZ4 ? "+lz4" : "") + (format.timed ? "+ts" : "");
+    uint64_t markerKey = MARKER_KEY;
+    MDB_val key{ sizeof(markerKey), &markerKey },
+            val{ marker.size(), (void*)marker.data() };
+    return mdb_put(txn, db, &key, &val, MDB_APPEND);
+}
+
+size_t BatchRecord::blobRefSize(uint64_t offset, uint64_t len) {
+    return varintSize(offset) + varintSize(len);
+}
+
+char* BatchRecord::putBlobRef(char* dst, uint64_t offset, uint64_t len) {
+    return putVarint(putVarint(dst, offset), len);
+}
+
+bool BatchRecord::getBlobRef(const MDB_val& ref, uint64_t& offset, uint64_t& len) {
+    const char* p = (const char*)ref.mv_data;
+    const char* end = p + ref.mv_size;
+    p = getVarint(p, end, offset);
+    return p && getVarint(p, end, len) == end;
+}
+
+bool BatchRecord::inflate(const MDB_val& record, const ChunkFormat& format, string& buf, MDB_val& plain) {
+    const char* p = (const char*)record.mv_data;
+    const char* end = p + record.mv_size;
+
+    uint64_t n, ms = 0, rawSize;
+    const char* body = getVarint(p, end, n);
+    if (body && format.timed) body = getVarint(body, end, ms);
+    if (body) body = getVarint(body, end, rawSize);
+    if (!body || rawSize > LZ4_MAX_INPUT_SIZE) {
+        cout << "Batch record error: malformed compressed record." << endl;
+        return false;
+    }
+
+    /* The plain layout keeps the count and time, minus the raw size varint. */
+    size_t header = varintSize(n) + (format.timed ? varintSize(ms) : 0);
+    if (rawSize == 0) {
+        buf.resize(header + (end - body));
+        char* dst = putVarint(&buf[0], n);
+        if (format.timed) putVarint(dst, ms);
+        memcpy(&buf[header], body, end - body);
+    } else {
+        buf.resize(header + rawSize);
+        char* dst = putVarint(&buf[0], n);
+        if (format.timed) putVarint(dst, ms);
+        if (LZ4_decompress_safe(body, &buf[header], int(end - body), int(rawSize)) != int(rawSize)) {
+            cout << "Batch record error: corrupt compressed record." << endl;
+            return false;
+        }
+    }
+
+    plain.mv_size = buf.size();
+    plain.mv_data = &buf[0];
+    return true;
+}
+
+bool BatchRecord::timeOf(const MDB_val& record, uint64_t& ms) {
+    uint64_t n;
+    const char* p = (const char*)record.mv_data;
+    const char* end = p + record.mv_size;
+    p = getVarint(p, end, n);
+    return p && getVarint(p, end, ms);
+}
+
+uint64_t BatchRecord::lastSeq(MDB_txn* txn, MDB_dbi db) {
+    MDBCursor cur(db, txn);
+    if (cur.gotoLast() != 0) return 0;
+
+    uint64_t last = cur.key<uint64_t>();
+    if (last == MARKER_KEY) return 0;
+
+    MDB_val record = cur.val();
+    if (cur.gotoFirst() == 0 && cur.key<uint64_t>() == MARKER_KEY) {
+        uint64_t n = count(record);
+        if (n) last += n - 1;
+    }
+    return last;
+}
+
+uint64_t BatchRecord::count(const MDB_val& record) {
+    uint64_t n;
+    const char* p = (const char*)record.mv_data;
+    return getVarint(p, p + record.mv_size, n) ? n : 0;
+}
+
+BatchRecord::BatchRecord(const MDB_val& record, const ChunkFormat& format) : _lens(nullptr), _lensEnd(nullptr), _data(nullptr), _end(nullptr), _left(0), _ms(0), _tagged(format.blobs), _blob(false) {
+    const char* p = (const char*)record.mv_data;
+    const char* end = p + record.mv_size;
+
+    uint64_t n, len, ms = 0;
+    p = getVarint(p, end, n);
+    if (p && format.timed) p = getVarint(p, end, ms);
+    if (!p) return;
+
+    /* The payloads start right after the last length. */
+    const char* data = p;
+    for (uint64_t i = 0; i < n && data; ++i) {
+        data = getVarint(data, end, len);
+    }
+    if (!data) return;
+
+    _lens = p;
+    _lensEnd = data;
+    _data = data;
+    _end = end;
+    _left = n;
+    _ms = ms;
+}
+
+bool BatchRecord::next(MDB_val& msg) {
+    if (_left == 0) return false;
+
+    uint64_t len;
+    _lens = getVarint(_lens, _lensEnd, len);
+    if (_lens && _tagged) {
+        _blob = len & 1;
+        len >>= 1;
+    }
+    if (!_lens || len > uint64_t(_end - _data)) {
+        _left = 0;
+        return false;
+    }
+
+    msg.mv_size = len;
+    msg.mv_data = (void*)_data;
+    _data += len;
+    --_left;
+    return true;
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+
+#include <lmdb/lmdb.h>
+#include "env.h"
+
+/*
+ * Batch records (TopicOpt::batched): one LMDB record holds a whole flush batch and is keyed
+ * by the sequence of its first message, so node headers, keys and page slack are paid once
+ * per batch. Layout: varint count, count varint lengths, then the payloads back to back.
+ * A chunk written this way carries a marker under key 0, which no message ever uses.
+ *
+ * In a compressed chunk the count is followed by a varint raw size and the compressed
+ * lengths and payloads, a raw size of 0 stores them as is (the batch did not shrink).
+ *
+ * In a chunk with blobs every length is shifted left by one, a set low bit marks a blob
+ * reference: the message lives in the chunk's blob file, the payload holds its varint
+ * offset and length there.
+ *
+ * In a timed chunk the count is followed by the varint wall clock time (ms) of the commit,
+ * see Topic::seekTime().
+ */
+struct ChunkFormat {
+    bool batched;
+    Compression codec;
+    bool blobs;
+    bool timed;
+};
+
+class BatchRecord {
+public:
+    static const uint64_t MARKER_KEY = 0;
+
+    static size_t varintSize(uint64_t v);
+    static char* putVarint(char* dst, uint64_t v);
+    /* nullptr when the varint runs past end. */
+    static const char* getVarint(const char* src, const char* end, uint64_t& v);
+
+    /* Chunk format, mark() is only valid on an empty chunk. */
+    static ChunkFormat format(MDB_txn* txn, MDB_dbi db);
+    static int mark(MDB_txn* txn, MDB_dbi db, const ChunkFormat& format);
+
+    /* Payload of a blob reference. */
+    static size_t blobRefSize(uint64_t offset, uint64_t len);
+    static char* putBlobRef(char* dst, uint64_t offset, uint64_t len);
+    static bool getBlobRef(const MDB_val& ref, uint64_t& offset, uint64_t& len);
+
+    /* Record of a compressed chunk in the plain layout, decompressed into buf when needed. */
+    static bool inflate(const MDB_val& record, const ChunkFormat& format, std::string& buf, MDB_val& plain);
+    /* Commit time of a record of a timed chunk. */
+    static bool timeOf(const MDB_val& record, uint64_t& ms);
+
+    /* Sequence of the last message of the chunk in either format, 0: empty chunk. */
+    static uint64_t lastSeq(MDB_txn* txn, MDB_dbi db);
+    /* Messages in a record, 0 when it is malformed. */
+    static uint64_t count(const MDB_val& record);
+
+public:
+    /* A record in the plain layout of a chunk of the given format. */
+    BatchRecord(const MDB_val& record, const ChunkFormat& format);
+    BatchRecord() : _lens(nullptr), _lensEnd(nullptr), _data(nullptr), _end(nullptr), _left(0), _ms(0), _tagged(false), _blob(false) {
+    }
+
+public:
+    /* The messages point into the record, they live as long as its transaction. */
+    bool next(MDB_val& msg);
+    inline uint64_t remaining() const { return _left; }
+    /* The last message is a blob reference, see getBlobRef(). */
+    inline bool isBlob() const { return _blob; }
+    /* Commit time of the record, 0 in a chunk that is not timed. */
+    inline uint64_t time() const { return _ms; }
+
+private:
+    const char* _lens;
+    const char* _lensEnd;
+    const char* _data;
+    const char* _end;
+    uint64_t _left;
+    uint64_t _ms;
+    bool _tagged, _blob;
+};
@@ -0,0 +1,262 @@
+#include <stdio.h>
+#include <iostream>
+
+#include "topic.h"
+#include "consumer.h"
+
+using namespace std;
+
+Consumer::Consumer(Topic* topic, const string& name) : Consumer(topic, uint64_t(0)) {
+    _name = name;
+
+    Txn txn(_topic->getEnv(), NULL, true);
+    _next = _topic->getConsumerHead(txn, name);
+    txn.abort();
+}
+
+Consumer::Consumer(Topic* topic, uint64_t from) : _topic(topic), _next(from), _chunk(0), _env(nullptr), _db(0), _txn(nullptr), _cursor(nullptr), _active(false), _live(false), _format{ false, COMPRESSION_NONE, false, false }, _inflatedUsed(0), _blobsUsed(0), _blobFile(nullptr) {
+}
+
+Consumer::~Consumer() {
+    closeChunk();
+}
+
+bool Consumer::openChunk(uint32_t chunk) {
+    char path[4096];
+    _topic->getChunkFilePath(path, chunk);
+
+    if (!ChunkEnvs::acquire(path, _env, _db)) return false;
+    _chunk = chunk;
+
+    int rc = mdb_txn_begin(_env, NULL, MDB_RDONLY, &_txn);
+    if (rc == 0) rc = mdb_cursor_open(_txn, _db, &_cursor);
+
+    if (rc != 0) {
+        cout << "Consumer open error: " << path << " " << mdb_strerror(rc) << endl;
+        closeChunk();
+        return false;
+    }
+
+    _active = true;
+    _format = BatchRecord::format(_txn, _db);
+    return true;
+}
+
+void Consumer::closeChunk() {
+    if (_cursor) mdb_cursor_close(_cursor);
+    if (_txn) mdb_txn_abort(_txn);
+    if (_env) {
+        char path[4096];
+        _topic->getChunkFilePath(path, _chunk);
+        ChunkEnvs::release(path);
+    }
+
+    _cursor = nullptr;
+    _txn = nullptr;
+    _env = nullptr;
+    _active = _live = false;
+    _batch = BatchRecord();
+
+    if (_blobFile) fclose(_blobFile);
+    _blobFile = nullptr;
+}
+
+bool Consumer::renew() {
+    if (!_env) {
+        Txn txn(_topic->getEnv(), NULL, true);
+        uint32_t chunk = _topic->getChunkFile(txn, _next);
+        txn.abort();
+
+        if (!openChunk(chunk)) return false;
+    }
+
+    /* A fresh snapshot in the same reader slot, the cursor follows the txn. */
+    if (_active) mdb_txn_reset(_txn);
+    int rc = mdb_txn_renew(_txn);
+    if (rc == 0) rc = mdb_cursor_renew(_txn, _cursor);
+    if (rc != 0) {
+        cout << "Consumer renew error: " << mdb_strerror(rc) << endl;
+        closeChunk();
+        return false;
+    }
+
+    _active = true;
+    _live = false;
+    _batch = BatchRecord();
+
+    /* A chunk opened before its producer marked it reads as the message format until then. */
+    if (!_format.batched) _format = BatchRecord::format(_txn, _db);
+    return true;
+}
+
+bool Consumer::nextChunk() {
+    Txn txn(_topic->getEnv(), NULL, true);
+    uint32_t chunk = _topic->getChunkFile(txn, _next);
+    txn.abort();
+
+    /* Still the head chunk: caught up. */
+    if (chunk == _chunk) return false;
+
+    closeChunk();
+    return renew();
+}
+
+bool Consumer::pull(size_t max, vector<MDB_val>& batch, uint64_t& first, vector<uint64_t>* times) {
+    batch.clear();
+    if (times) times->clear();
+    _inflatedUsed = _blobsUsed = 0;
+    if (!renew()) return false;
+
+    uint64_t seq;
+    MDB_val val;
+    while (batch.size() < max) {
+        if (!nextMessage(seq, val)) {
+            /* Switching chunks would unmap the views handed out already. */
+            if (!batch.empty() || !nextChunk()) break;
+            continue;
+        }
+
+        if (batch.empty()) first = seq;
+        batch.push_back(val);
+        if (times) times->push_back(_format.timed ? _batch.time() : 0);
+
+        /* Blobs are copies, one at a time keeps the buffers at about one blob. */
+        if (_format.batched && _batch.isBlob()) break;
+    }
+
+    if (batch.empty()) release();
+    return !batch.empty();
+}
+
+bool Consumer::nextMessage(uint64_t& seq, MDB_val& val) {
+    if (_format.batched) {
+        if (!_batch.next(val)) {
+            MDB_val key, record;
+            if (!_live) {
+                if (!seekBatch()) return false;
+            } else if (mdb_cursor_get(_cursor, &key, &record, MDB_NEXT) == 0) {
+                _next = *(uint64_t*)key.mv_data;
+                if (!loadRecord(record)) return false;
+            } else {
+                return false;
+            }
+            if (!_batch.next(val)) return false;
+        }
+
+        if (_batch.isBlob() && !loadBlob(val)) return false;
+        seq = _next++;
+        return true;
+    }
+
+    MDB_val key{ sizeof(_next), &_next };
+    if (mdb_cursor_get(_cursor, &key, &val, _live ? MDB_NEXT : MDB_SET_RANGE) != 0) return false;
+
+    _live = true;
+    seq = *(uint64_t*)key.mv_data;
+    _next = seq + 1;
+    return true;
+}
+
+bool Consumer::loadRecord(const MDB_val& record) {
+    MDB_val plain = record;
+    if (_format.codec != COMPRESSION_NONE && !BatchRecord::inflate(record, _format, buffer(_inflated, _inflatedUsed), plain)) return false;
+
+    _batch = BatchRecord(plain, _format);
+    return true;
+}
+
+bool Consumer::seekBatch() {
+    /* The record holding _next is keyed by its first message: _next itself or the record before. */
+    if (_next == BatchRecord::MARKER_KEY) _next = 1;
+    MDB_val key{ sizeof(_next), &_next }, val, prevKey, prevVal;
+    int rc = mdb_cursor_get(_cursor, &key, &val, MDB_SET_RANGE);
+    if (rc != 0 || *(uint64_t*)key.mv_data != _next) {
+        int prc = mdb_cursor_get(_cursor, &prevKey, &prevVal, rc == 0 ? MDB_PREV : MDB_LAST);
+        uint64_t prevFirst = prc == 0 ? *(uint64_t*)prevKey.mv_data : BatchRecord::MARKER_KEY;
+        if (prevFirst != BatchRecord::MARKER_KEY && _next < prevFirst + BatchRecord::count(prevVal)) {
+            key = prevKey;
+            val = prevVal;
+            rc = 0;
+        } else if (rc == 0) {
+            /* MDB_PREV moved the cursor off the record after _next, which is the one to read. */
+            key.mv_size = sizeof(_next);
+            key.mv_data = &_next;
+            rc = mdb_cursor_get(_cursor, &key, &val, MDB_SET_RANGE);
+        }
+    }
+    if (rc != 0) return false;
+
+    /* A gap before the record (e.g. reading from 0) starts at its first message. */
+    uint64_t first = *(uint64_t*)key.mv_data;
+    if (_next < first) _next = first;
+    if (!loadRecord(val)) return false;
+    _live = true;
+
+    MDB_val skipped;
+    for (uint64_t skip = _next - first; skip > 0; --skip) {
+        if (!_batch.next(skipped)) return false;
+    }
+    return _batch.remaining() > 0;
+}
+
+bool Consumer::loadBlob(MDB_val& val) {
+    uint64_t offset, len;
+    if (!BatchRecord::getBlobRef(val, offset, len)) {
+        cout << "Consumer error: malformed blob reference at " << _next << "." << endl;
+        return false;
+    }
+
+    char path[4096];
+    _topic->getBlobFilePath(path, _chunk);
+    if (!_blobFile) _blobFile = fopen(path, "rb");
+
+#ifdef _WIN32
+    bool found = _blobFile && _fseeki64(_blobFile, offset, SEEK_SET) == 0;
+#else
+    bool found = _blobFile && fseeko(_blobFile, offset, SEEK_SET) == 0;
+#endif
+    string& buf = buffer(_blobs, _blobsUsed);
+    buf.resize(len);
+    if (!found || fread(&buf[0], 1, len, _blobFile) != len) {
+        cout << "Consumer error: cannot read blob " << _next << " from " << path << "." << endl;
+        return false;
+    }
+
+    val.mv_size = len;
+    val.mv_data = &buf[0];
+    return true;
+}
+
+string& Consumer::buffer(deque<string>& pool, size_t& used) {
+    if (used == pool.size()) pool.emplace_back();
+    return pool[used++];
+}
+
+bool Consumer::commit() {
+    if (_name.empty()) return false;
+
+    Txn txn(_topic->getEnv(), NULL);
+    _topic->setConsumerHead(txn, _name, _next);
+    return txn.commit() == 0;
+}
+
+void Consumer::seek(uint64_t seq) {
+    _next = seq;
+
+    Txn txn(_topic->getEnv(), NULL, true);
+    uint32_t chunk = _topic->getChunkFile(txn, seq);
+    txn.abort();
+
+    /* Within the open chunk the next pull() seeks the cursor, otherwise it opens the chunk of seq. */
+    if (_env && chunk == _chunk) {
+        release();
+    } else {
+        closeChunk();
+    }
+}
+
+void Consumer::release() {
+    if (_active) mdb_txn_reset(_txn);
+    _active = _live = false;
+    _batch = BatchRecord();
+}
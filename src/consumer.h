@@ -0,0 +1,85 @@
+#pragma once
+
+#include <stdio.h>
+#include <vector>
+#include <deque>
+#include <string>
+
+#include <lmdb/lmdb.h>
+#include "env.h"
+#include "batch.h"
+
+class Topic;
+
+/*
+ * Batched reader of one chunk series, at the head of a named consumer or at any sequence.
+ * Chunk envs are shared with the producers and other consumers of the process (see ChunkEnvs),
+ * so consumers may run in any threads and next to a producer of the topic (which should open
+ * a chunk first: one a consumer opened stays read-only until it moves on). One read
+ * txn per chunk is kept: every pull() resets and renews it, which refreshes the snapshot
+ * without giving up the reader slot. Messages come back as views straight into the chunk
+ * map, only compressed records and blobs are copied into buffers of the consumer. The next
+ * chunk is opened once the current one is read to its end.
+ */
+class Consumer {
+public:
+    /* Starts at the consumer head of name (see Topic::getConsumerHead()). */
+    Consumer(Topic* topic, const std::string& name);
+    /* Starts at sequence from, commit() is a no-op. */
+    Consumer(Topic* topic, uint64_t from);
+    ~Consumer();
+
+private:
+    Consumer(const Consumer&);
+    Consumer& operator=(const Consumer&);
+
+public:
+    /*
+     * Up to max messages with the sequences first, first + 1, ... A batch never spans two
+     * chunks and ends after a blob. The views stay valid until the next pull(), seek() or
+     * release(). times, if given, gets the commit time of every message (0: not recorded, the
+     * chunk is not timed). false: nothing to read, the txn is released.
+     */
+    bool pull(size_t max, std::vector<MDB_val>& batch, uint64_t& first, std::vector<uint64_t>* times = nullptr);
+
+    /* Stores the position as the consumer head. */
+    bool commit();
+    void seek(uint64_t seq);
+    /* Ends the txn of an idle consumer, so the producer can reuse the pages it pins. */
+    void release();
+
+    inline Topic* getTopic() { return _topic; }
+    inline uint64_t position() const { return _next; } // Sequence of the next message to pull.
+
+private:
+    bool openChunk(uint32_t chunk);
+    void closeChunk();
+    bool renew();
+    bool nextChunk();
+    bool nextMessage(uint64_t& seq, MDB_val& val);
+    bool loadRecord(const MDB_val& record);
+    bool seekBatch();
+    bool loadBlob(MDB_val& val);
+    std::string& buffer(std::deque<std::string>& pool, size_t& used);
+
+private:
+    Topic* _topic;
+    std::string _name;
+    uint64_t _next;
+
+    uint32_t _chunk;
+    MDB_env* _env;
+    MDB_dbi _db;
+    MDB_txn* _txn;
+    MDB_cursor* _cursor;
+    bool _active; // _txn is renewed, not reset.
+    bool _live; // The cursor sits on the record of _batch (or the message before _next) of this snapshot.
+
+    ChunkFormat _format;
+    BatchRecord _batch; // Unread rest of the record holding _next.
+
+    /* Decompressed records and blobs of the last batch, reused by the next one (a deque never moves them). */
+    std::deque<std::string> _inflated, _blobs;
+    size_t _inflatedUsed, _blobsUsed;
+    FILE* _blobFile; // Of _chunk, opened by the first blob read.
+};
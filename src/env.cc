@@ -1,31 +1,61 @@
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/statvfs.h>
+#endif
+
+#include <iostream>
+#include <condition_variable>
+
 #include "topic.h"
 #include "env.h"
+#include "reaper.h"
 
 using namespace std;
 
-Env* EnvManager::getEnv(const string& root, EnvOpt *opt) {
+EnvManager& EnvManager::instance() {
     static EnvManager instance;
+    return instance;
+}
 
-    std::lock_guard<std::mutex> guard(instance._mtx);
-    EnvPtr& ptr = instance._envMap[root];
+Env* EnvManager::getEnv(const string& root, EnvOpt *opt) {
+    EnvManager& manager = instance();
+
+    std::lock_guard<std::mutex> guard(manager._mtx);
+    EnvPtr& ptr = manager._envMap[root];
     if (!ptr.get()) ptr.reset(new Env(root, opt));
 
     return ptr.get();
 }
 
-Env::Env(const string& root, EnvOpt* opt) : _root(root), _env(nullptr) {
-    mdb_env_create(&_env);
+void EnvManager::afterFork() {
+    EnvManager& manager = instance();
 
+    std::lock_guard<std::mutex> guard(manager._mtx);
+    for (auto& env : manager._envMap) {
+        env.second->reopen();
+    }
+}
+
+Env::Env(const string& root, EnvOpt* opt, const string& metaName, Env* legacy) : _root(root), _metaName(metaName), _env(nullptr), _legacy(legacy) {
     if (opt) {
-        mdb_env_set_mapsize(_env, opt->mapSize);
-        mdb_env_set_maxdbs(_env, opt->maxTopicNum);
+        _opt = *opt;
     } else {
         /* Default opt */
-        mdb_env_set_mapsize(_env, 256 * 1024 * 1024);
-        mdb_env_set_maxdbs(_env, 256);
+        _opt.mapSize = 256 * 1024 * 1024;
+        _opt.maxTopicNum = 256;
+        _opt.metaShards = 1;
     }
 
-    string path = root + "/__meta__";
+    open();
+}
+
+void Env::open() {
+    mdb_env_create(&_env);
+    mdb_env_set_mapsize(_env, _opt.mapSize);
+    mdb_env_set_maxdbs(_env, _opt.maxTopicNum);
+
+    string path = _root + "/" + _metaName;
     int rc = mdb_env_open(_env, path.c_str(), MDB_NOSYNC | MDB_NOSUBDIR, 0666);
     if (rc != 0) {
         mdb_env_close(_env);
@@ -39,6 +69,7 @@ Env::Env(const string& root, EnvOpt* opt) : _root(root), _env(nullptr) {
 }
 
 Env::~Env() {
+    _metaEnvs.clear();
     _topics.clear();
     if (_env) {
         mdb_env_close(_env);
@@ -46,10 +77,151 @@ Env::~Env() {
     }
 }
 
+uint64_t Env::freeDiskBytes() {
+#ifdef _WIN32
+    ULARGE_INTEGER avail;
+    if (!GetDiskFreeSpaceExA(_root.c_str(), &avail, NULL, NULL)) return UINT64_MAX;
+    return avail.QuadPart;
+#else
+    struct statvfs st;
+    if (statvfs(_root.c_str(), &st) != 0) return UINT64_MAX;
+    return uint64_t(st.f_bavail) * st.f_frsize;
+#endif
+}
+
+void Env::reopen() {
+    std::lock_guard<std::mutex> guard(_mtx);
+
+    /* mdb_env_close() frees the reader slots of the opening pid, the parent only ever takes write txns here. */
+    if (_env) mdb_env_close(_env);
+    open();
+
+    for (auto& topic : _topics) {
+        topic.second->reopen();
+    }
+
+    for (auto& metaEnv : _metaEnvs) {
+        metaEnv.second->reopen();
+    }
+}
+
 Topic* Env::getTopic(const string& name) {
+    if (_opt.metaShards != 1) {
+        return getMetaEnv(name)->getTopic(name);
+    }
+
     std::lock_guard<std::mutex> guard(_mtx);
     TopicPtr& ptr = _topics[name];
-    if (!ptr.get()) ptr.reset(new Topic(this, name));
+    if (!ptr.get()) {
+        if (_legacy) Topic::migrate(_legacy, this, name);
+        ptr.reset(new Topic(this, name));
+    }
+
+    return ptr.get();
+}
+
+Env* Env::getMetaEnv(const string& topic) {
+    string metaName = "__meta__.";
+    if (_opt.metaShards == 0) {
+        metaName += topic;
+    } else {
+        /* FNV-1a: the shard of a topic must not change between builds or restarts. */
+        uint32_t hash = 2166136261u;
+        for (char c : topic) {
+            hash = (hash ^ uint8_t(c)) * 16777619u;
+        }
+        metaName += "s" + to_string(hash % _opt.metaShards);
+    }
+
+    std::lock_guard<std::mutex> guard(_mtx);
+    EnvPtr& ptr = _metaEnvs[metaName];
+    if (!ptr.get()) {
+        EnvOpt opt = _opt;
+        opt.metaShards = 1;
+        ptr.reset(new Env(_root, &opt, metaName, this));
+    }
 
     return ptr.get();
 }
+
+struct SharedChunk {
+    MDB_env* env;
+    MDB_dbi db;
+    int refs;
+    bool writable;
+};
+
+static mutex sharedChunksMtx;
+static condition_variable sharedChunksCv;
+static map<string, SharedChunk> sharedChunks;
+
+static bool acquireChunk(const char* path, bool writable, unsigned int flags, size_t mapSize, MDB_env*& env, MDB_dbi& db) {
+    unique_lock<mutex> guard(sharedChunksMtx);
+
+    auto readOnly = [&]() {
+        auto it = sharedChunks.find(path);
+        return it != sharedChunks.end() && !it->second.writable;
+    };
+    if (writable && readOnly() && !sharedChunksCv.wait_for(guard, chrono::seconds(1), [&]() { return !readOnly(); })) {
+        cout << "LMDB_QUEUE WARNING: Chunk " << path << " is held read-only in this process, cannot write to it." << endl;
+        return false;
+    }
+
+    auto it = sharedChunks.find(path);
+    if (it == sharedChunks.end()) {
+        /* Already dropped from meta and on its way out. */
+        if (!Reaper::instance().pin(path)) return false;
+
+        MDB_txn* txn = nullptr;
+        SharedChunk shared = { nullptr, 0, 0, writable };
+        mdb_env_create(&shared.env);
+        if (writable) mdb_env_set_mapsize(shared.env, mapSize);
+        int rc = mdb_env_open(shared.env, path, (writable ? flags : MDB_RDONLY) | MDB_NOSUBDIR | MDB_NOTLS, 0664);
+        if (rc == 0 && writable) {
+            int cleared = 0;
+            mdb_reader_check(shared.env, &cleared);
+        }
+        if (rc == 0) rc = mdb_txn_begin(shared.env, NULL, writable ? 0 : MDB_RDONLY, &txn);
+        if (rc == 0) rc = mdb_dbi_open(txn, NULL, writable ? MDB_CREATE : 0, &shared.db);
+        if (rc == 0) rc = mdb_set_compare(txn, shared.db, mdbIntCmp<uint64_t>);
+        if (rc == 0) {
+            rc = mdb_txn_commit(txn);
+        } else if (txn) {
+            mdb_txn_abort(txn);
+        }
+
+        if (rc != 0) {
+            cout << "Chunk open error: " << path << " " << mdb_strerror(rc) << endl;
+            mdb_env_close(shared.env);
+            Reaper::instance().unpin(path);
+            return false;
+        }
+
+        it = sharedChunks.insert(make_pair(string(path), shared)).first;
+    }
+
+    ++it->second.refs;
+    env = it->second.env;
+    db = it->second.db;
+    return true;
+}
+
+bool ChunkEnvs::acquire(const char* path, MDB_env*& env, MDB_dbi& db) {
+    return acquireChunk(path, false, 0, 0, env, db);
+}
+
+bool ChunkEnvs::acquireWritable(const char* path, unsigned int flags, size_t mapSize, MDB_env*& env, MDB_dbi& db) {
+    return acquireChunk(path, true, flags, mapSize, env, db);
+}
+
+void ChunkEnvs::release(const char* path) {
+    lock_guard<mutex> guard(sharedChunksMtx);
+
+    auto it = sharedChunks.find(path);
+    if (it != sharedChunks.end() && --it->second.refs == 0) {
+        mdb_env_close(it->second.env);
+        Reaper::instance().unpin(it->first);
+        sharedChunks.erase(it);
+        sharedChunksCv.notify_all();
+    }
+}
@@ -1,9 +1,11 @@
 #pragma once
 
 #include <mutex>
+#include <chrono>
 #include <map>
 #include <memory>
 #include <string>
+#include <vector>
 
 #include "wrapper.h"
 
@@ -12,16 +14,80 @@ class Topic;
 struct EnvOpt {
     size_t maxTopicNum;
     size_t mapSize;
+    size_t metaShards; // 1: every topic in __meta__, 0: a meta env per topic, n: topics hashed over n meta envs.
+};
+
+/* What a chunk commit guarantees, the loss window traded against throughput. */
+enum Durability {
+    DURABILITY_NONE,       // MDB_NOSYNC: the kernel writes pages back whenever it likes.
+    DURABILITY_PERIODIC,   // MDB_NOSYNC plus mdb_env_sync() every syncIntervalMs on a thread of the producer.
+    DURABILITY_MAPASYNC,   // MDB_WRITEMAP | MDB_MAPASYNC: a commit schedules an asynchronous msync.
+    DURABILITY_NOMETASYNC, // Data pages are synced on commit, the meta page one commit later.
+    DURABILITY_BATCH       // Every commit is fully synced.
+};
+
+/* Codec of batch records, applied once per flush batch. */
+enum Compression {
+    COMPRESSION_NONE,
+    COMPRESSION_LZ4
 };
 
 struct TopicOpt {
     size_t chunkSize;
     size_t chunksToKeep;
+    bool partitioned; // Producers write their own chunk series, see Producer::partition().
+    size_t flushTargetUs; // Commit latency target of the adaptive flush, 0: flush every cacheMax items.
+    Durability durability;
+    size_t syncIntervalMs; // DURABILITY_PERIODIC only.
+    bool batched; // New chunks store one record per flush batch, see BatchRecord.
+    Compression compression; // Implies batched.
+    size_t blobThreshold; // Messages of at least this many bytes go to the chunk's blob file, 0: none. Implies batched.
+
+    /* Retention on top of chunksToKeep, 0: no limit. Checked on rotation and checkpoint, the head chunk is never removed. */
+    uint64_t maxAgeMs; // Chunks whose newest message is older.
+    uint64_t maxBytes; // Disk usage of all chunks and their blob files.
+    uint64_t rotateIntervalMs; // Chunks end on multiples of this wall clock interval (UTC).
+    uint64_t minFreeBytes; // The oldest chunks are trimmed while the file system has less free space.
+};
+
+/* Meta value of a chunk (key: its file number). Older trees stored firstSeq only, the rest reads as 0. */
+struct ChunkMeta {
+    uint64_t firstSeq;
+    uint64_t createdMs; // Wall clock time the chunk became the head.
+    uint64_t closedMs;  // Time of the rotation away from it, 0: head chunk.
+    uint64_t bytes;     // Chunk and blob file size when it was closed.
+    uint64_t minMs, maxMs; // Commit times of its first and last batch, 0: none recorded.
+};
+
+/* Meta value of a range of a consumer group (key: group and start), see GroupConsumer. */
+struct GroupLease {
+    uint64_t start, end; // Sequences [start, end), end shrinks when an idle member steals the rest.
+    uint64_t next;       // First sequence not committed yet, next >= end: completed.
+    uint64_t owner;      // Member id, 0: none.
+    uint64_t expiresMs;  // Wall clock time the owner's claim runs out unless it commits.
+};
+
+inline uint64_t wallClockMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+struct ChunkStatus {
+    uint32_t file;
+    uint64_t firstSeq;
+    uint64_t entries;
+    uint64_t lastSeq; // 0: empty chunk.
+    size_t pageSize;
+    size_t pagesUsed;
+    size_t mapSize;
+    uint64_t diskBytes;
+    uint64_t createdMs, closedMs, minMs, maxMs; // See ChunkMeta.
 };
 
 struct TopicStatus{
     uint64_t producerHead;
     std::map<std::string, uint64_t> consumerHeads;
+    std::vector<uint32_t> partitions;
+    std::vector<ChunkStatus> chunks;
 };
 
 class Env {
@@ -29,7 +95,7 @@ private:
     friend class EnvManager;
     friend class Txn;
 
-    Env(const std::string& root, EnvOpt *opt);
+    Env(const std::string& root, EnvOpt *opt, const std::string& metaName = "__meta__", Env* legacy = nullptr);
     Env(const Env&);
     Env& operator=(const Env&);
 
@@ -38,25 +104,45 @@ public:
 
     const std::string& getRoot() { return _root; }
     MDB_env* getMdbEnv() { return _env; }
+    /* Space left on the file system of the root for unprivileged users. */
+    uint64_t freeDiskBytes();
 
     Topic* getTopic(const std::string& name);
+    void reopen();
+
+private:
+    void open();
+    Env* getMetaEnv(const std::string& topic);
 
 private:
-    std::string _root;
+    std::string _root, _metaName;
+    EnvOpt _opt;
     MDB_env *_env;
+    Env* _legacy; // The root's __meta__ of a per-topic / shard meta env, topics found there are migrated.
 
     typedef std::unique_ptr<Topic> TopicPtr;
     typedef std::map<std::string, TopicPtr> TopicMap;
+    typedef std::unique_ptr<Env> EnvPtr;
+    typedef std::map<std::string, EnvPtr> EnvMap;
 
     std::mutex _mtx;
     TopicMap _topics;
+    EnvMap _metaEnvs;
 };
 
 class EnvManager {
 public:
     static Env* getEnv(const std::string& root, EnvOpt *opt = NULL);
 
+    /*
+     * Reopens every meta env in a forked child. An env inherited over fork() takes write txns
+     * but no read txns: LMDB registers readers under the pid of the process that opened it.
+     */
+    static void afterFork();
+
 private:
+    static EnvManager& instance();
+
     std::mutex _mtx;
 
     typedef std::unique_ptr<Env> EnvPtr;
@@ -66,9 +152,16 @@ private:
 
 class Txn {
 public:
-    Txn(Env* env, MDB_env* consumerOrProducerEnv, bool readOnly = false) : _abort(false), _envTxn(nullptr), _cpTxn(nullptr) {
-        mdb_txn_begin(env->_env, NULL, 0, &_envTxn);
-        if (consumerOrProducerEnv) mdb_txn_begin(consumerOrProducerEnv, NULL, 0, &_cpTxn);
+    /* envReadOnly: the consumer / producer txn is begun first and meta is only read, see Producer::pushImpl(). */
+    Txn(Env* env, MDB_env* consumerOrProducerEnv, bool readOnly = false, bool envReadOnly = false) : _abort(false), _envTxn(nullptr), _cpTxn(nullptr) {
+        unsigned int flags = readOnly ? MDB_RDONLY : 0;
+        if (envReadOnly && consumerOrProducerEnv) {
+            mdb_txn_begin(consumerOrProducerEnv, NULL, flags, &_cpTxn);
+            mdb_txn_begin(env->_env, NULL, MDB_RDONLY, &_envTxn);
+        } else {
+            mdb_txn_begin(env->_env, NULL, flags, &_envTxn);
+            if (consumerOrProducerEnv) mdb_txn_begin(consumerOrProducerEnv, NULL, flags, &_cpTxn);
+        }
     }
 
     ~Txn() {
@@ -116,4 +209,23 @@ template<typename INT_TYPE> int mdbIntCmp(const MDB_val *a, const MDB_val *b) {
     INT_TYPE ia = *(INT_TYPE*)a->mv_data;
     INT_TYPE ib = *(INT_TYPE*)b->mv_data;
     return ia < ib ? -1 : ia > ib ? 1 : 0;
-}
\ No newline at end of file
+}
+
+/*
+ * The env of every chunk file open in this process, shared by its producers and readers: LMDB
+ * allows one env per file and process, a second one would take the lock file as if it were
+ * alone and drop the first one's locks when closed. Envs are opened with MDB_NOTLS, so read
+ * txns may live in any thread, and pinned with the Reaper until the last release closes them.
+ */
+class ChunkEnvs {
+public:
+    /* The process's env of an existing chunk, opened read-only if there is none yet. */
+    static bool acquire(const char* path, MDB_env*& env, MDB_dbi& db);
+    /*
+     * A writable env, created with flags and mapSize if there is none yet. A chunk readers of
+     * this process hold read-only is waited for (briefly: status and time seeks only read it
+     * for a moment), false if they keep it, or if the chunk is being reaped.
+     */
+    static bool acquireWritable(const char* path, unsigned int flags, size_t mapSize, MDB_env*& env, MDB_dbi& db);
+    static void release(const char* path);
+};
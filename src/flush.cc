@@ -0,0 +1,31 @@
+#include <algorithm>
+
+#include "flush.h"
+
+using namespace std;
+
+FlushController::FlushController(chrono::microseconds target, chrono::milliseconds maxInterval, size_t minBytes, size_t maxBytes, chrono::milliseconds minInterval)
+    : _targetUs(target.count()), _minBytes(minBytes), _maxBytes(maxBytes), _step(max<size_t>(minBytes, 64 * 1024)),
+      _minIntervalMs(minInterval.count()), _maxIntervalMs(max(maxInterval, minInterval).count()),
+      _batchBytes(max<size_t>(minBytes, 256 * 1024)), _intervalMs(_maxIntervalMs), _rate(0), _lastFlush(chrono::steady_clock::now()) {
+}
+
+void FlushController::onFlush(size_t bytes, uint64_t commitUs) {
+    chrono::steady_clock::time_point now = chrono::steady_clock::now();
+    double elapsedMs = max(chrono::duration<double, milli>(now - _lastFlush).count(), 0.001);
+    _lastFlush = now;
+
+    _rate = _rate == 0 ? bytes / elapsedMs : 0.8 * _rate + 0.2 * (bytes / elapsedMs);
+
+    size_t budget = _batchBytes.load(memory_order_relaxed);
+    if (commitUs > _targetUs) {
+        budget = max(_minBytes, budget / 2);
+    } else if (bytes * 2 >= budget) {
+        /* Only grow when batches actually reach the budget, a budget nobody fills proves nothing. */
+        budget = min(_maxBytes, budget + _step);
+    }
+    _batchBytes.store(budget, memory_order_relaxed);
+
+    int64_t interval = _rate > 0 ? int64_t(budget / _rate) : _maxIntervalMs;
+    _intervalMs.store(min(max(interval, _minIntervalMs), _maxIntervalMs), memory_order_relaxed);
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <stdint.h>
+
+/*
+ * Adaptive flush policy of a Producer. The byte budget of a batch follows AIMD against a
+ * commit latency target: it grows additively while txn.commit() stays under the target and
+ * is halved when a commit overshoots. The flush interval is the time the observed arrival
+ * rate needs to fill one budget, clamped between minInterval and maxInterval.
+ */
+class FlushController {
+public:
+    FlushController(std::chrono::microseconds target, std::chrono::milliseconds maxInterval,
+        size_t minBytes = 16 * 1024, size_t maxBytes = 64 * 1024 * 1024,
+        std::chrono::milliseconds minInterval = std::chrono::milliseconds(2));
+
+private:
+    FlushController(const FlushController&);
+    FlushController& operator=(const FlushController&);
+
+public:
+    inline size_t batchBytes() const { return _batchBytes.load(std::memory_order_relaxed); }
+    inline std::chrono::milliseconds interval() const { return std::chrono::milliseconds(_intervalMs.load(std::memory_order_relaxed)); }
+
+    /* Called by the (single) draining thread after every committed batch. */
+    void onFlush(size_t bytes, uint64_t commitUs);
+
+private:
+    const uint64_t _targetUs;
+    const size_t _minBytes, _maxBytes, _step;
+    const int64_t _minIntervalMs, _maxIntervalMs;
+
+    std::atomic<size_t> _batchBytes;
+    std::atomic<int64_t> _intervalMs;
+
+    double _rate; // Bytes per millisecond, EWMA.
+    std::chrono::steady_clock::time_point _lastFlush;
+};
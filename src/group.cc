@@ -0,0 +1,223 @@
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+
+#include "topic.h"
+#include "group.h"
+
+using namespace std;
+
+/* A steal leaves both halves at least this many messages, smaller rests are not worth the lease writes. */
+static const uint64_t minStealSize = 128;
+
+/* Members are told apart by process and instance, the lease table is shared by processes. */
+static uint64_t newOwnerId() {
+    static atomic<uint32_t> members(0);
+#ifdef _WIN32
+    uint64_t pid = _getpid();
+#else
+    uint64_t pid = getpid();
+#endif
+    return (pid << 32) | ++members;
+}
+
+GroupConsumer::GroupConsumer(Topic* topic, const string& group, uint64_t rangeSize, uint64_t leaseMs) : _topic(topic), _group(group), _rangeSize(max(rangeSize, uint64_t(1))), _leaseMs(leaseMs), _owner(newOwnerId()), _consumer(topic, uint64_t(0)), _leased(false), _lease{ 0, 0, 0, 0, 0 }, _pos(0) {
+}
+
+GroupConsumer::~GroupConsumer() {
+    release();
+}
+
+bool GroupConsumer::pull(size_t max, vector<MDB_val>& batch, uint64_t& first) {
+    batch.clear();
+
+    while (true) {
+        if (_leased) refresh();
+        if (_leased && _pos >= _lease.end) commit();
+        if (!_leased && !claim()) {
+            _consumer.release();
+            return false;
+        }
+
+        /* Caught up within the range: the lease is kept for what is still to be written. */
+        if (!_consumer.pull(min(uint64_t(max), _lease.end - _pos), batch, first)) return false;
+
+        if (first < _lease.end) {
+            if (first + batch.size() > _lease.end) batch.resize(_lease.end - first);
+            _pos = first + batch.size();
+            return true;
+        }
+
+        /* The rest of the range is gone (retention), it is complete. */
+        batch.clear();
+        _pos = _lease.end;
+    }
+}
+
+bool GroupConsumer::commit() {
+    if (!_leased) return false;
+
+    Txn txn(_topic->getEnv(), NULL);
+    vector<GroupLease> leases = _topic->getLeases(txn, _group);
+    auto mine = find_if(leases.begin(), leases.end(), [this](const GroupLease& lease) { return lease.start == _lease.start; });
+    if (mine == leases.end() || mine->owner != _owner) {
+        /* Ran out and was taken over: the new owner reads it from its last commit. */
+        txn.abort();
+        _leased = false;
+        return false;
+    }
+
+    mine->next = max(mine->next, _pos);
+    mine->expiresMs = wallClockMs() + _leaseMs;
+    if (mine->next >= mine->end) {
+        mine->owner = 0;
+        _leased = false;
+    }
+    _lease = *mine;
+    _topic->setLease(txn, _group, *mine);
+
+    advance(txn, leases);
+    return txn.commit() == 0;
+}
+
+void GroupConsumer::release() {
+    if (!_leased) return;
+
+    Txn txn(_topic->getEnv(), NULL);
+    vector<GroupLease> leases = _topic->getLeases(txn, _group);
+    for (auto& lease : leases) {
+        if (lease.start != _lease.start || lease.owner != _owner) continue;
+
+        lease.owner = 0;
+        lease.expiresMs = 0;
+        _topic->setLease(txn, _group, lease);
+    }
+    txn.commit();
+
+    _leased = false;
+    _consumer.release();
+}
+
+bool GroupConsumer::refresh() {
+    Txn txn(_topic->getEnv(), NULL, true);
+    vector<GroupLease> leases = _topic->getLeases(txn, _group);
+    txn.abort();
+
+    for (auto& lease : leases) {
+        if (lease.start != _lease.start || lease.owner != _owner) continue;
+
+        /* A steal only moves the end. */
+        _lease.end = lease.end;
+        return true;
+    }
+
+    _leased = false;
+    return false;
+}
+
+bool GroupConsumer::peek(uint64_t seq, uint64_t& first) {
+    _consumer.seek(seq);
+    return _consumer.pull(1, _peeked, first);
+}
+
+bool GroupConsumer::claim() {
+    enum { TAKE_OVER, CUT, STEAL };
+
+    for (int attempt = 0; attempt < 3; ++attempt) {
+        /* The candidate comes from a snapshot, chunks are only read outside the meta write txn. */
+        Txn snapshot(_topic->getEnv(), NULL, true);
+        vector<GroupLease> leases = _topic->getLeases(snapshot, _group);
+        uint64_t tail = leases.empty() ? _topic->getConsumerHead(snapshot, _group) : leases.back().end;
+        uint64_t written = _topic->getProducerHead(snapshot) + 1;
+        snapshot.abort();
+
+        uint64_t now = wallClockMs(), first = 0, mid = 0;
+        int mode = TAKE_OVER;
+        GroupLease victim = { 0, 0, 0, 0, 0 }, claimed;
+
+        auto expired = find_if(leases.begin(), leases.end(), [now](const GroupLease& lease) { return lease.next < lease.end && lease.expiresMs < now; });
+        if (expired != leases.end()) {
+            victim = *expired;
+        } else if (peek(tail, first)) {
+            mode = CUT;
+        } else {
+            /* Nothing new: the largest unread rest of a running range, as far as it is written (checkpoint). */
+            uint64_t unread = 0;
+            for (auto& lease : leases) {
+                uint64_t rest = min(lease.end, written) > lease.next ? min(lease.end, written) - lease.next : 0;
+                if (rest > unread) {
+                    victim = lease;
+                    unread = rest;
+                }
+            }
+            mid = victim.next + unread / 2;
+            if (unread < 2 * minStealSize || !peek(mid, first) || first >= victim.end) return false;
+            mode = STEAL;
+        }
+
+        Txn txn(_topic->getEnv(), NULL);
+        vector<GroupLease> current = _topic->getLeases(txn, _group);
+        auto same = find_if(current.begin(), current.end(), [&victim](const GroupLease& lease) { return lease.start == victim.start; });
+
+        bool valid;
+        if (mode == TAKE_OVER) {
+            valid = same != current.end() && same->owner == victim.owner && same->expiresMs == victim.expiresMs;
+            claimed = victim;
+        } else if (mode == CUT) {
+            valid = (current.empty() ? _topic->getConsumerHead(txn, _group) : current.back().end) == tail;
+
+            /* Skips what retention removed already, and ends with the chunk of the first message. */
+            uint64_t end = first + _rangeSize;
+            uint64_t chunkEnd = _topic->getChunkFirstSeq(txn, _topic->getChunkFile(txn, first) + 1);
+            if (chunkEnd > first) end = min(end, chunkEnd);
+            claimed = { tail, end, max(first, tail), 0, 0 };
+        } else {
+            valid = same != current.end() && same->end == victim.end && same->next < mid;
+            if (valid) {
+                same->end = mid;
+                _topic->setLease(txn, _group, *same);
+            }
+            claimed = { mid, victim.end, mid, 0, 0 };
+        }
+
+        if (!valid) {
+            txn.abort();
+            continue;
+        }
+
+        claimed.owner = _owner;
+        claimed.expiresMs = now + _leaseMs;
+        _topic->setLease(txn, _group, claimed);
+        if (txn.commit() != 0) return false;
+
+        _leased = true;
+        _lease = claimed;
+        _pos = claimed.next;
+        _consumer.seek(_pos);
+        return true;
+    }
+
+    return false;
+}
+
+void GroupConsumer::advance(Txn& txn, vector<GroupLease>& leases) {
+    uint64_t head = _topic->getConsumerHead(txn, _group), from = head;
+
+    /* Completed ranges go once nothing below them is pending, the oldest pending one holds the head at its progress. */
+    for (auto& lease : leases) {
+        if (lease.next < lease.end) {
+            head = max(head, lease.next);
+            break;
+        }
+
+        _topic->removeLease(txn, _group, lease.start);
+        head = lease.end;
+    }
+
+    if (head != from) _topic->setConsumerHead(txn, _group, head);
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <vector>
+#include <string>
+
+#include <lmdb/lmdb.h>
+#include "env.h"
+#include "consumer.h"
+
+class Topic;
+
+/*
+ * Member of consumer group `group`. The sequences are cut into ranges of up to rangeSize
+ * messages (never past the end of a chunk), which members claim from a lease table in the
+ * topic's meta and read with a Consumer. commit() stores the progress in the lease and renews
+ * it. When no new range can be cut, an idle member takes over a lease that ran out (e.g. of a
+ * dead process) or steals the unread upper half of the largest running range. The group head
+ * (the consumer head of `group`) is the low-water mark: the committed progress of the oldest
+ * unfinished range, the ranges below it are completed and dropped from the table.
+ *
+ * Delivery is at least once: what a member pulled after its last commit() is delivered again
+ * when its lease runs out, or when a steal cuts its range short before it notices.
+ */
+class GroupConsumer {
+public:
+    GroupConsumer(Topic* topic, const std::string& group, uint64_t rangeSize = 4096, uint64_t leaseMs = 30000);
+    /* Hands the range back, see release(). */
+    ~GroupConsumer();
+
+private:
+    GroupConsumer(const GroupConsumer&);
+    GroupConsumer& operator=(const GroupConsumer&);
+
+public:
+    /*
+     * Up to max messages of the member's range, see Consumer::pull(). A range read to its end
+     * is completed (the last batch counts as processed) and the next one claimed. false:
+     * nothing to read, or nothing to claim.
+     */
+    bool pull(size_t max, std::vector<MDB_val>& batch, uint64_t& first);
+
+    /* Marks everything pulled so far as processed and renews the lease. false: the lease was lost. */
+    bool commit();
+    /* Gives up the range, the next owner resumes from the last commit(). */
+    void release();
+
+    inline uint64_t getOwner() const { return _owner; }
+
+private:
+    bool claim();
+    bool refresh();
+    bool peek(uint64_t seq, uint64_t& first);
+    void advance(Txn& txn, std::vector<GroupLease>& leases);
+
+private:
+    Topic* _topic;
+    std::string _group;
+    uint64_t _rangeSize, _leaseMs;
+    uint64_t _owner;
+
+    Consumer _consumer;
+    std::vector<MDB_val> _peeked;
+
+    bool _leased;
+    GroupLease _lease; // As of the last claim, refresh or commit.
+    uint64_t _pos; // Next sequence to pull.
+};
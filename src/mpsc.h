@@ -0,0 +1,85 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <stddef.h>
+
+/*
+ * Bounded lock-free multi-producer / single-consumer queue (sequence-stamped cells).
+ * Producers claim a cell with one CAS and never wait for the consumer; the single
+ * consumer pops without any atomic read-modify-write. T must be default constructible
+ * and move assignable.
+ */
+template<class T> class MpscQueue {
+public:
+    explicit MpscQueue(size_t capacity) : _mask(roundUp(capacity) - 1), _cells(new Cell[_mask + 1]), _enqueuePos(0), _dequeuePos(0) {
+        for (size_t i = 0; i <= _mask; ++i) {
+            _cells[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+private:
+    MpscQueue(const MpscQueue&);
+    MpscQueue& operator=(const MpscQueue&);
+
+public:
+    inline size_t capacity() const { return _mask + 1; }
+
+    /* False when the queue is full, item is left untouched then. */
+    bool push(T&& item) {
+        size_t pos = _enqueuePos.load(std::memory_order_relaxed);
+        Cell* cell;
+
+        for (;;) {
+            cell = &_cells[pos & _mask];
+            size_t seq = cell->seq.load(std::memory_order_acquire);
+            intptr_t dif = intptr_t(seq) - intptr_t(pos);
+
+            if (dif == 0) {
+                if (_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            } else if (dif < 0) {
+                return false;
+            } else {
+                pos = _enqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+
+        cell->item = std::move(item);
+        cell->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    /* Consumer side only. */
+    bool pop(T& item) {
+        Cell* cell = &_cells[_dequeuePos & _mask];
+        size_t seq = cell->seq.load(std::memory_order_acquire);
+        if (intptr_t(seq) - intptr_t(_dequeuePos + 1) < 0) return false;
+
+        item = std::move(cell->item);
+        cell->seq.store(_dequeuePos + _mask + 1, std::memory_order_release);
+        ++_dequeuePos;
+        return true;
+    }
+
+private:
+    static size_t roundUp(size_t v) {
+        size_t ret = 2;
+        while (ret < v) ret <<= 1;
+        return ret;
+    }
+
+private:
+    struct Cell {
+        std::atomic<size_t> seq;
+        T item;
+    };
+
+    const size_t _mask;
+    std::unique_ptr<Cell[]> _cells;
+
+    /* Producers and the consumer touch different cache lines. */
+    char _pad0[64];
+    std::atomic<size_t> _enqueuePos;
+    char _pad1[64];
+    size_t _dequeuePos;
+};
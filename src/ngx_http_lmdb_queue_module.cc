@@ -3,14 +3,37 @@
 #include <string>
 #include <memory>
 #include <map>
+#include <sstream>
 #include <limits.h>
 #include <stdlib.h>
 #include <stdio.h>
 
 #include "producer.h"
+#include "ring.h"
+#include "topic.h"
+
+/* Shared ingest ring of a topic, lives in the topic's shm zone (zone->data). */
+struct RingCtx {
+	size_t size;
+	Ring* ring;
+};
+
+/* Runtime counters of a topic, slots live in the lmdb_queue_stats shm zone and are found by name. */
+struct StatsSlot {
+	char topic[128];
+	ProducerStats stats;
+};
+
+struct StatsCtx {
+	size_t count;
+	StatsSlot* slots;
+};
 
 std::string queue_path;
 std::map<std::string, std::unique_ptr<Producer> > producers;
+StatsCtx* statsCtx = NULL;
+std::map<std::string, RingCtx*> rings;
+std::vector<std::unique_ptr<RingWriter> > ringWriters;
 
 extern "C" {
 	#include <ngx_config.h>
@@ -24,33 +47,56 @@ extern "C" {
 	/* Directive handlers */
 	static char *ngx_http_lmdb_queue(ngx_conf_t *cf, ngx_command_t *cmd, void *conf); // Declare lmdb_queue
 	static char *ngx_http_lmdb_queue_topic(ngx_conf_t *cf, ngx_command_t *cmd, void *conf); // Declare lmdb_queue topic
+	static char *ngx_http_lmdb_queue_memory(ngx_conf_t *cf, ngx_command_t *cmd, void *conf); // Per worker cache budget
 	static char *ngx_http_lmdb_queue_push(ngx_conf_t *cf, ngx_command_t *cmd, void *conf); // Declare lmdb_queue topic
+	static char *ngx_http_lmdb_queue_ingest(ngx_conf_t *cf, ngx_command_t *cmd, void *conf); // Bulk ingest content handler
+	static char *ngx_http_lmdb_queue_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf); // Topic status content handler
 
 	/* Filter */
 	ngx_http_output_body_filter_pt ngx_http_next_body_filter;
 	static ngx_int_t ngx_http_lmdb_queue_handler_init(ngx_conf_t *cf);
 	static ngx_int_t ngx_http_lmdb_queue_handler(ngx_http_request_t *r);
+	static ngx_int_t ngx_http_lmdb_queue_ingest_handler(ngx_http_request_t *r);
+	static ngx_int_t ngx_http_lmdb_queue_status_handler(ngx_http_request_t *r);
 
 	/* Directives */
 	static ngx_command_t ngx_http_lmdb_queue_commands[] = {
 		{ ngx_string("lmdb_queue"),
-		  NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE1,
+		  NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE12,
 		  ngx_http_lmdb_queue,
 		  NGX_HTTP_MAIN_CONF_OFFSET,
 		  0,
 		  NULL },
 		{ ngx_string("lmdb_queue_topic"),
-		  NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE3,
+		  NGX_HTTP_MAIN_CONF | NGX_CONF_2MORE,
 		  ngx_http_lmdb_queue_topic,
 		  NGX_HTTP_MAIN_CONF_OFFSET,
 		  0,
 		  NULL },
+		{ ngx_string("lmdb_queue_memory"),
+		  NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE1,
+		  ngx_http_lmdb_queue_memory,
+		  NGX_HTTP_MAIN_CONF_OFFSET,
+		  0,
+		  NULL },
 		{ ngx_string("lmdb_queue_push"),
-		  NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE2,
+		  NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_2MORE,
 		  ngx_http_lmdb_queue_push,
 		  NGX_HTTP_LOC_CONF_OFFSET,
 		  0,
 		  NULL },
+		{ ngx_string("lmdb_queue_ingest"),
+		  NGX_HTTP_LOC_CONF | NGX_CONF_TAKE12,
+		  ngx_http_lmdb_queue_ingest,
+		  NGX_HTTP_LOC_CONF_OFFSET,
+		  0,
+		  NULL },
+		{ ngx_string("lmdb_queue_status"),
+		  NGX_HTTP_LOC_CONF | NGX_CONF_NOARGS,
+		  ngx_http_lmdb_queue_status,
+		  NGX_HTTP_LOC_CONF_OFFSET,
+		  0,
+		  NULL },
 		ngx_null_command
 	};
 
@@ -83,14 +129,44 @@ extern "C" {
 		NGX_MODULE_V1_PADDING
 	};
 	
+	enum ngx_http_lmdb_queue_framing {
+		NGX_HTTP_LMDB_QUEUE_FRAMING_LEN32, // 4 byte big endian length before every message
+		NGX_HTTP_LMDB_QUEUE_FRAMING_NEWLINE // One message per line, empty lines skipped
+	};
+
+	/* Compiled data_format: literal span, variable reference or the raw request body chain. */
+	enum ngx_http_lmdb_queue_op_type {
+		NGX_HTTP_LMDB_QUEUE_OP_LITERAL,
+		NGX_HTTP_LMDB_QUEUE_OP_VARIABLE,
+		NGX_HTTP_LMDB_QUEUE_OP_BODY
+	};
+
+	struct ngx_http_lmdb_queue_op {
+		ngx_uint_t type;
+		ngx_int_t index;
+		size_t len;
+		u_char *data;
+	};
+
 	struct ngx_http_lmdb_queue_loc_conf {
 		Producer* producer;
-		
-		size_t data_format_len;
-		u_char data_format[1024 * 8];
-		
+
+		size_t literal_len;
 		size_t vars_count;
-		ngx_int_t* vars;		
+
+		size_t ops_count;
+		ngx_http_lmdb_queue_op* ops;
+
+		RingCtx* ring;
+		size_t direct_min; // Records of at least this size are rendered into pooled buffers, 0: never.
+
+		/* Checked before any format variable is evaluated. */
+		ngx_int_t if_index; // Skip the push when empty or "0", NGX_ERROR: always push.
+		ngx_uint_t sample; // Pushed share in 1/10000, keyed by sample_key_index when set.
+		ngx_int_t sample_key_index;
+
+		Producer* ingest_producer;
+		ngx_uint_t ingest_framing; // NGX_HTTP_LMDB_QUEUE_FRAMING_LEN32 or NGX_HTTP_LMDB_QUEUE_FRAMING_NEWLINE.
 	};
 	
 	static void *ngx_http_lmdb_queue_create_loc_conf(ngx_conf_t *cf) {
@@ -100,15 +176,38 @@ extern "C" {
 		}
 		
 		ngx_memzero(conf, sizeof(ngx_http_lmdb_queue_loc_conf));
+		conf->if_index = NGX_ERROR;
+		conf->sample = 10000;
+		conf->sample_key_index = NGX_ERROR;
 		return conf;
 	}
 
 	static char *ngx_http_lmdb_queue(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
 		ngx_str_t *args = (ngx_str_t*)cf->args->elts;
 		const char *path = (const char*)args[1].data;
+		EnvOpt opt = { 256, 256 * 1024 * 1024, 1 };
+		if (cf->args->nelts > 2) {
+			if (ngx_strcmp(args[2].data, "meta=shared") == 0) {
+				opt.metaShards = 1;
+			} else if (ngx_strcmp(args[2].data, "meta=topic") == 0) {
+				opt.metaShards = 0;
+			} else if (args[2].len > 5 && ngx_strncmp(args[2].data, "meta=", 5) == 0) {
+				ngx_int_t shards = ngx_atoi(args[2].data + 5, args[2].len - 5);
+				if (shards == NGX_ERROR || shards < 1) {
+					ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "%V: Invalid meta shard count.", &args[2]);
+					return (char*)NGX_CONF_ERROR;
+				}
+				opt.metaShards = shards;
+			} else {
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "%V: Unknown queue option (should be meta=shared|topic|<shards>).", &args[2]);
+				return (char*)NGX_CONF_ERROR;
+			}
+		}
+
 		int res = mkdir(path, 0766);
 		if (res == 0 || errno == EEXIST) {
 			queue_path = path;
+			EnvManager::getEnv(queue_path, &opt);
 			return NGX_CONF_OK;
 		} else {
 			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "%V %s", &args[1], strerror(errno));
@@ -116,9 +215,77 @@ extern "C" {
 		}
 	}
 	
+	static char *ngx_http_lmdb_queue_memory(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+		ngx_str_t *args = (ngx_str_t*)cf->args->elts;
+		ssize_t size = ngx_parse_size(&args[1]);
+		if (size == NGX_ERROR) {
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "%V: Invalid memory budget.", &args[1]);
+			return (char*)NGX_CONF_ERROR;
+		}
+
+		/* Set before the workers fork, every worker then has a budget of its own. */
+		Producer::setMemoryBudget(size);
+		return NGX_CONF_OK;
+	}
+
+	static ngx_int_t ngx_http_lmdb_queue_init_ring_zone(ngx_shm_zone_t *shm_zone, void *data) {
+		RingCtx *ctx = (RingCtx*)shm_zone->data;
+		if (data) {
+			/* Reload: keep the ring (and any records still in it) of the previous cycle. */
+			ctx->ring = ((RingCtx*)data)->ring;
+			return NGX_OK;
+		}
+
+		ngx_slab_pool_t *shpool = (ngx_slab_pool_t*)shm_zone->shm.addr;
+		void *mem = ngx_slab_alloc(shpool, ctx->size);
+		if (mem == NULL) {
+			return NGX_ERROR;
+		}
+
+		ctx->ring = Ring::create(mem, ctx->size);
+		return ctx->ring ? NGX_OK : NGX_ERROR;
+	}
+
+	static char *ngx_http_lmdb_queue_topic_ring(ngx_conf_t *cf, const char *name, ngx_str_t *sizeStr) {
+		ssize_t size = ngx_parse_size(sizeStr);
+		if (size == NGX_ERROR || size_t(size) < 1024 * 1024) {
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "%V: Invalid ring size (should be at least 1m).", sizeStr);
+			return (char*)NGX_CONF_ERROR;
+		}
+
+		RingCtx *ctx = (RingCtx*)ngx_pcalloc(cf->pool, sizeof(RingCtx));
+		if (ctx == NULL) {
+			return (char*)NGX_CONF_ERROR;
+		}
+		ctx->size = size_t(size);
+
+		ngx_str_t zoneName;
+		zoneName.data = (u_char*)ngx_pnalloc(cf->pool, sizeof("lmdb_queue_ring_") + strlen(name));
+		if (zoneName.data == NULL) {
+			return (char*)NGX_CONF_ERROR;
+		}
+		zoneName.len = ngx_sprintf(zoneName.data, "lmdb_queue_ring_%s", name) - zoneName.data;
+
+		/* Slab page bookkeeping takes roughly 1/64 of the zone on top of the ring itself. */
+		ngx_shm_zone_t *zone = ngx_shared_memory_add(cf, &zoneName, ctx->size + ctx->size / 32 + 128 * 1024, &ngx_http_lmdb_queue_module);
+		if (zone == NULL) {
+			return (char*)NGX_CONF_ERROR;
+		}
+
+		zone->init = ngx_http_lmdb_queue_init_ring_zone;
+		zone->data = ctx;
+		rings[name] = ctx;
+		return NGX_CONF_OK;
+	}
+
 	static char *ngx_http_lmdb_queue_topic(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
 		ngx_str_t *args = (ngx_str_t*)cf->args->elts;
 		const char *name = (const char*)args[1].data;
+
+		if (cf->args->nelts < 4) {
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "%V: Topic chunk size and chunks to keep are required.", &args[1]);
+			return (char*)NGX_CONF_ERROR;
+		}
 		
 		const char *chunkSizeStr = (const char*)args[2].data;
 		size_t chunkSize = strtoull(chunkSizeStr, NULL, 10);
@@ -157,49 +324,234 @@ extern "C" {
 			return (char*)NGX_CONF_ERROR;
 		}
 		
-		//printf("Args: %s %zu %zu", name, chunkSize, chunksToKeep);
+		TopicOpt qopt = { chunkSize, chunksToKeep, false, 0, DURABILITY_NONE, 0, false, COMPRESSION_NONE, 0, 0, 0, 0, 0 };
+		Producer::OverflowPolicy overflow = Producer::OVERFLOW_BLOCK;
+		size_t highWater = 0;
+		ngx_int_t overflowWait = NGX_ERROR;
+
+		rings.erase(name);
+		for (ngx_uint_t i = 4; i < cf->args->nelts; ++i) {
+			if (args[i].len > 5 && ngx_strncmp(args[i].data, "ring=", 5) == 0) {
+				ngx_str_t sizeStr { args[i].len - 5, args[i].data + 5 };
+				if (ngx_http_lmdb_queue_topic_ring(cf, name, &sizeStr) != NGX_CONF_OK) {
+					return (char*)NGX_CONF_ERROR;
+				}
+				continue;
+			}
+
+			if (ngx_strcmp(args[i].data, "partition=worker") == 0) {
+				qopt.partitioned = true;
+				continue;
+			}
+
+			if (ngx_strcmp(args[i].data, "format=batch") == 0 || ngx_strcmp(args[i].data, "format=message") == 0) {
+				qopt.batched = args[i].data[7] == 'b';
+				continue;
+			}
+
+			if (ngx_strcmp(args[i].data, "compression=lz4") == 0 || ngx_strcmp(args[i].data, "compression=none") == 0) {
+				qopt.compression = args[i].data[12] == 'l' ? COMPRESSION_LZ4 : COMPRESSION_NONE;
+				continue;
+			}
+
+			if (args[i].len > 15 && ngx_strncmp(args[i].data, "blob_threshold=", 15) == 0) {
+				ngx_str_t sizeStr { args[i].len - 15, args[i].data + 15 };
+				ssize_t size = ngx_parse_size(&sizeStr);
+				if (size == NGX_ERROR || size <= 0) {
+					ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "%V: Invalid blob threshold.", &args[i]);
+					return (char*)NGX_CONF_ERROR;
+				}
+				qopt.blobThreshold = size;
+				continue;
+			}
+
+			if (args[i].len > 13 && ngx_strncmp(args[i].data, "flush_target=", 13) == 0) {
+				ngx_str_t timeStr { args[i].len - 13, args[i].data + 13 };
+				ngx_int_t ms = ngx_parse_time(&timeStr, 0);
+				if (ms == NGX_ERROR || ms <= 0) {
+					ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "%V: Invalid flush target.", &args[i]);
+					return (char*)NGX_CONF_ERROR;
+				}
+				qopt.flushTargetUs = size_t(ms) * 1000;
+				continue;
+			}
+
+			if (args[i].len > 11 && ngx_strncmp(args[i].data, "durability=", 11) == 0) {
+				u_char *mode = args[i].data + 11;
+				if (ngx_strcmp(mode, "none") == 0) {
+					qopt.durability = DURABILITY_NONE;
+				} else if (ngx_strcmp(mode, "per-batch") == 0) {
+					qopt.durability = DURABILITY_BATCH;
+				} else if (ngx_strcmp(mode, "nometasync") == 0) {
+					qopt.durability = DURABILITY_NOMETASYNC;
+				} else if (ngx_strcmp(mode, "writemap+mapasync") == 0 || ngx_strcmp(mode, "writemap") == 0) {
+					qopt.durability = DURABILITY_MAPASYNC;
+				} else if (ngx_strncmp(mode, "periodic=", 9) == 0 || ngx_strncmp(mode, "periodic:", 9) == 0) {
+					/* A bare number is milliseconds, "periodic:" is the older spelling. */
+					ngx_str_t timeStr { args[i].len - 20, mode + 9 };
+					ngx_int_t ms = ngx_parse_time(&timeStr, 0);
+					if (ms == NGX_ERROR || ms <= 0) {
+						ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "%V: Invalid sync interval.", &args[i]);
+						return (char*)NGX_CONF_ERROR;
+					}
+					qopt.durability = DURABILITY_PERIODIC;
+					qopt.syncIntervalMs = ms;
+				} else {
+					ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "%V: Invalid durability (should be none|periodic=<ms>|writemap+mapasync|nometasync|per-batch).", &args[i]);
+					return (char*)NGX_CONF_ERROR;
+				}
+				continue;
+			}
+
+			if (args[i].len > 8 && ngx_strncmp(args[i].data, "max_age=", 8) == 0) {
+				ngx_str_t timeStr { args[i].len - 8, args[i].data + 8 };
+				ngx_int_t sec = ngx_parse_time(&timeStr, 1);
+				if (sec == NGX_ERROR || sec <= 0) {
+					ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "%V: Invalid max age.", &args[i]);
+					return (char*)NGX_CONF_ERROR;
+				}
+				qopt.maxAgeMs = uint64_t(sec) * 1000;
+				continue;
+			}
+
+			if (args[i].len > 7 && ngx_strncmp(args[i].data, "rotate=", 7) == 0) {
+				ngx_str_t timeStr { args[i].len - 7, args[i].data + 7 };
+				ngx_int_t sec = ngx_parse_time(&timeStr, 1);
+				if (sec == NGX_ERROR || sec <= 0) {
+					ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "%V: Invalid rotation interval.", &args[i]);
+					return (char*)NGX_CONF_ERROR;
+				}
+				qopt.rotateIntervalMs = uint64_t(sec) * 1000;
+				continue;
+			}
+
+			if (args[i].len > 10 && ngx_strncmp(args[i].data, "max_bytes=", 10) == 0) {
+				ngx_str_t sizeStr { args[i].len - 10, args[i].data + 10 };
+				off_t size = ngx_parse_offset(&sizeStr);
+				if (size == NGX_ERROR || size <= 0) {
+					ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "%V: Invalid max bytes.", &args[i]);
+					return (char*)NGX_CONF_ERROR;
+				}
+				qopt.maxBytes = size;
+				continue;
+			}
+
+			if (args[i].len > 9 && ngx_strncmp(args[i].data, "min_free=", 9) == 0) {
+				ngx_str_t sizeStr { args[i].len - 9, args[i].data + 9 };
+				off_t size = ngx_parse_offset(&sizeStr);
+				if (size == NGX_ERROR || size <= 0) {
+					ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "%V: Invalid min free space.", &args[i]);
+					return (char*)NGX_CONF_ERROR;
+				}
+				qopt.minFreeBytes = size;
+				continue;
+			}
+
+			if (args[i].len > 11 && ngx_strncmp(args[i].data, "high_water=", 11) == 0) {
+				ngx_str_t sizeStr { args[i].len - 11, args[i].data + 11 };
+				ssize_t size = ngx_parse_size(&sizeStr);
+				if (size == NGX_ERROR) {
+					ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "%V: Invalid high water mark.", &args[i]);
+					return (char*)NGX_CONF_ERROR;
+				}
+				highWater = size;
+				continue;
+			}
+
+			if (args[i].len > 9 && ngx_strncmp(args[i].data, "overflow=", 9) == 0) {
+				u_char *policy = args[i].data + 9;
+				if (ngx_strcmp(policy, "block") == 0) {
+					overflow = Producer::OVERFLOW_BLOCK;
+				} else if (ngx_strcmp(policy, "drop_newest") == 0) {
+					overflow = Producer::OVERFLOW_DROP_NEWEST;
+				} else if (ngx_strcmp(policy, "drop_oldest") == 0) {
+					overflow = Producer::OVERFLOW_DROP_OLDEST;
+				} else if (ngx_strcmp(policy, "spill") == 0) {
+					overflow = Producer::OVERFLOW_SPILL;
+				} else {
+					ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "%V: Invalid overflow policy (should be block|drop_newest|drop_oldest|spill).", &args[i]);
+					return (char*)NGX_CONF_ERROR;
+				}
+				continue;
+			}
+
+			if (args[i].len > 14 && ngx_strncmp(args[i].data, "overflow_wait=", 14) == 0) {
+				ngx_str_t timeStr { args[i].len - 14, args[i].data + 14 };
+				overflowWait = ngx_parse_time(&timeStr, 0);
+				if (overflowWait == NGX_ERROR) {
+					ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "%V: Invalid overflow wait.", &args[i]);
+					return (char*)NGX_CONF_ERROR;
+				}
+				continue;
+			}
+
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "%V: Unknown topic option.", &args[i]);
+			return (char*)NGX_CONF_ERROR;
+		}
+
 		auto &ptr = producers[name];
 		if (ptr.get() == NULL) {
-			TopicOpt qopt = { chunkSize, chunksToKeep };
 			ptr.reset(new Producer(queue_path, name, &qopt));
 		}
+
+		/* Never unbounded: a push runs on the event loop. */
+		if (overflowWait == NGX_ERROR) {
+			overflowWait = 100;
+		}
+		ptr->setOverflow(overflow, highWater, std::chrono::milliseconds(overflowWait));
 		
 		return NGX_CONF_OK;
 	}
 	
-	static char *ngx_http_lmdb_queue_push(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
-		ngx_str_t *args = (ngx_str_t*)cf->args->elts;
-
-		const char *topic = (const char*)args[1].data;
-		auto producerIter = producers.find(topic);
-		
-		if (producerIter == producers.end()) {
-			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "Topic '%V' not exists.", &args[1]);
-			return (char*)NGX_CONF_ERROR;
+	static ngx_int_t ngx_http_lmdb_queue_compile_format(ngx_conf_t *cf, ngx_http_lmdb_queue_loc_conf *locconf, ngx_str_t *format) {
+		/* Unescaping never grows a literal, so one buffer of format->len holds all of them. */
+		u_char *literals = (u_char*)ngx_pnalloc(cf->pool, format->len + 1);
+		if (literals == NULL) {
+			return NGX_ERROR;
 		}
-		
-		ngx_http_lmdb_queue_loc_conf *locconf = (ngx_http_lmdb_queue_loc_conf*)conf;
-		
-		std::vector<ngx_int_t> varIndexes;
-		u_char *end = args[2].data + args[2].len, *varCur = NULL, *outCur = locconf->data_format;
-		for (u_char *s = args[2].data; s < end;) {			
+
+		std::vector<ngx_http_lmdb_queue_op> ops;
+		locconf->vars_count = 0;
+		u_char *end = format->data + format->len, *litStart = literals, *outCur = literals;
+		auto flushLiteral = [&]() {
+			if (outCur > litStart) {
+				ops.push_back(ngx_http_lmdb_queue_op{ NGX_HTTP_LMDB_QUEUE_OP_LITERAL, NGX_ERROR, size_t(outCur - litStart), litStart });
+				litStart = outCur;
+			}
+		};
+
+		for (u_char *s = format->data; s < end;) {
 			if (*s == '$') {
-				varCur = ++s;
-				*outCur++ = '\1';
+				u_char *varCur = ++s;
 				while (s < end && ((*s >= '0' && *s <= '9') || (*s >= 'a' && *s <= 'z') || (*s >= 'A' && *s <= 'Z') || *s == '_')) {
 					++s;
 				}
 
 				ngx_str_t varName { size_t(s - varCur), varCur };
+				if (varName.len == 0) {
+					ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "%V: Empty variable name (use '\\$' for a literal '$').", format);
+					return NGX_ERROR;
+				}
+
+				flushLiteral();
+
+				/* $request_body is streamed from r->request_body->bufs, never flattened into a variable. */
+				static ngx_str_t bodyVar = ngx_string("request_body");
+				if (varName.len == bodyVar.len && ngx_strncmp(varName.data, bodyVar.data, bodyVar.len) == 0) {
+					ops.push_back(ngx_http_lmdb_queue_op{ NGX_HTTP_LMDB_QUEUE_OP_BODY, NGX_ERROR, 0, NULL });
+					continue;
+				}
+
 				ngx_int_t idx = ngx_http_get_variable_index(cf, &varName);
 				if (idx == NGX_ERROR) {
-					return (char*)NGX_CONF_ERROR;
+					return NGX_ERROR;
 				}
-				
-				varIndexes.push_back(idx);
+
+				ops.push_back(ngx_http_lmdb_queue_op{ NGX_HTTP_LMDB_QUEUE_OP_VARIABLE, idx, 0, NULL });
+				++locconf->vars_count;
 				continue;
 			}
-			
+
 			if (*s == '\\' && s + 1 < end) {
 				if (*(s + 1) == '0') {
 					*outCur++ = 0;
@@ -212,21 +564,208 @@ extern "C" {
 					s += 2;
 					continue;
 				}
-			}			
-			
+			}
+
 			*outCur++ = *s++;
 		}
+
+		flushLiteral();
+
+		locconf->literal_len = size_t(outCur - literals);
+		locconf->ops_count = ops.size();
+		locconf->ops = (ngx_http_lmdb_queue_op*)ngx_palloc(cf->pool, ops.size() * sizeof(ngx_http_lmdb_queue_op));
+		if (locconf->ops == NULL) {
+			return NGX_ERROR;
+		}
+
+		std::copy(ops.begin(), ops.end(), locconf->ops);
+		return NGX_OK;
+	}
+
+	static char *ngx_http_lmdb_queue_push(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+		ngx_str_t *args = (ngx_str_t*)cf->args->elts;
+
+		const char *topic = (const char*)args[1].data;
+		auto producerIter = producers.find(topic);
 		
-		locconf->data_format_len = size_t(outCur - locconf->data_format);
+		if (producerIter == producers.end()) {
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "Topic '%V' not exists.", &args[1]);
+			return (char*)NGX_CONF_ERROR;
+		}
+		
+		ngx_http_lmdb_queue_loc_conf *locconf = (ngx_http_lmdb_queue_loc_conf*)conf;
+		if (ngx_http_lmdb_queue_compile_format(cf, locconf, &args[2]) != NGX_OK) {
+			return (char*)NGX_CONF_ERROR;
+		}
+
+		for (ngx_uint_t i = 3; i < cf->args->nelts; ++i) {
+			if (args[i].len > 7 && ngx_strncmp(args[i].data, "direct=", 7) == 0) {
+				ngx_str_t sizeStr { args[i].len - 7, args[i].data + 7 };
+				ssize_t directMin = ngx_parse_size(&sizeStr);
+				if (directMin == NGX_ERROR) {
+					ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "%V: Invalid direct size.", &args[i]);
+					return (char*)NGX_CONF_ERROR;
+				}
+
+				locconf->direct_min = size_t(directMin);
+				continue;
+			}
+
+			if (args[i].len > 4 && ngx_strncmp(args[i].data, "if=$", 4) == 0) {
+				ngx_str_t varName { args[i].len - 4, args[i].data + 4 };
+				locconf->if_index = ngx_http_get_variable_index(cf, &varName);
+				if (locconf->if_index == NGX_ERROR) {
+					return (char*)NGX_CONF_ERROR;
+				}
+				continue;
+			}
+
+			if (args[i].len > 7 && ngx_strncmp(args[i].data, "sample=", 7) == 0) {
+				ngx_int_t sample = ngx_atofp(args[i].data + 7, args[i].len - 7, 4);
+				if (sample == NGX_ERROR || sample > 10000) {
+					ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "%V: Invalid sample ratio (should between 0 and 1).", &args[i]);
+					return (char*)NGX_CONF_ERROR;
+				}
+
+				locconf->sample = ngx_uint_t(sample);
+				continue;
+			}
+
+			if (args[i].len > 12 && ngx_strncmp(args[i].data, "sample_key=$", 12) == 0) {
+				ngx_str_t varName { args[i].len - 12, args[i].data + 12 };
+				locconf->sample_key_index = ngx_http_get_variable_index(cf, &varName);
+				if (locconf->sample_key_index == NGX_ERROR) {
+					return (char*)NGX_CONF_ERROR;
+				}
+				continue;
+			}
+
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "%V: Unknown push option.", &args[i]);
+			return (char*)NGX_CONF_ERROR;
+		}
+
+		auto ringIter = rings.find(topic);
+		locconf->ring = ringIter == rings.end() ? NULL : ringIter->second;
 		locconf->producer = producerIter->second.get();
-		locconf->vars_count = varIndexes.size();
-		locconf->vars = (ngx_int_t*)ngx_pcalloc(cf->pool, varIndexes.size() * sizeof(ngx_int_t));
-		std::copy(varIndexes.begin(), varIndexes.end(), locconf->vars);
+		return NGX_CONF_OK;
+	}
+
+	static char *ngx_http_lmdb_queue_ingest(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+		ngx_str_t *args = (ngx_str_t*)cf->args->elts;
+
+		const char *topic = (const char*)args[1].data;
+		auto producerIter = producers.find(topic);
+
+		if (producerIter == producers.end()) {
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "Topic '%V' not exists.", &args[1]);
+			return (char*)NGX_CONF_ERROR;
+		}
+
+		ngx_http_lmdb_queue_loc_conf *locconf = (ngx_http_lmdb_queue_loc_conf*)conf;
+		locconf->ingest_framing = NGX_HTTP_LMDB_QUEUE_FRAMING_LEN32;
+
+		if (cf->args->nelts > 2) {
+			if (ngx_strcmp(args[2].data, "framing=len32") == 0) {
+				locconf->ingest_framing = NGX_HTTP_LMDB_QUEUE_FRAMING_LEN32;
+			} else if (ngx_strcmp(args[2].data, "framing=newline") == 0) {
+				locconf->ingest_framing = NGX_HTTP_LMDB_QUEUE_FRAMING_NEWLINE;
+			} else {
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "%V: Invalid framing (should be framing=len32|newline).", &args[2]);
+				return (char*)NGX_CONF_ERROR;
+			}
+		}
+
+		locconf->ingest_producer = producerIter->second.get();
+
+		ngx_http_core_loc_conf_t *clcf = (ngx_http_core_loc_conf_t*)ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+		clcf->handler = ngx_http_lmdb_queue_ingest_handler;
+		return NGX_CONF_OK;
+	}
 
+	static char *ngx_http_lmdb_queue_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+		ngx_http_core_loc_conf_t *clcf = (ngx_http_core_loc_conf_t*)ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+		clcf->handler = ngx_http_lmdb_queue_status_handler;
 		return NGX_CONF_OK;
 	}
 
+	static StatsSlot *ngx_http_lmdb_queue_stats_slot(const std::string& topic) {
+		if (statsCtx == NULL || statsCtx->slots == NULL) {
+			return NULL;
+		}
+
+		for (size_t i = 0; i < statsCtx->count; ++i) {
+			if (topic == statsCtx->slots[i].topic) {
+				return &statsCtx->slots[i];
+			}
+		}
+
+		return NULL;
+	}
+
+	static ngx_int_t ngx_http_lmdb_queue_init_stats_zone(ngx_shm_zone_t *shm_zone, void *data) {
+		StatsCtx *ctx = (StatsCtx*)shm_zone->data;
+
+		if (data) {
+			/* Reload with the same zone size: keep counters, free the slots of removed topics. */
+			ctx->slots = ((StatsCtx*)data)->slots;
+			for (size_t i = 0; i < ctx->count; ++i) {
+				if (producers.find(ctx->slots[i].topic) == producers.end()) {
+					ctx->slots[i].topic[0] = 0;
+					ctx->slots[i].stats.reset();
+				}
+			}
+		} else {
+			ngx_slab_pool_t *shpool = (ngx_slab_pool_t*)shm_zone->shm.addr;
+			ctx->slots = (StatsSlot*)ngx_slab_calloc(shpool, ctx->count * sizeof(StatsSlot));
+			if (ctx->slots == NULL) {
+				return NGX_ERROR;
+			}
+		}
+
+		for (auto& producer : producers) {
+			if (ngx_http_lmdb_queue_stats_slot(producer.first)) continue;
+
+			for (size_t i = 0; i < ctx->count; ++i) {
+				if (ctx->slots[i].topic[0] == 0) {
+					ngx_cpystrn((u_char*)ctx->slots[i].topic, (u_char*)producer.first.c_str(), sizeof(ctx->slots[i].topic));
+					ctx->slots[i].stats.reset();
+					break;
+				}
+			}
+		}
+
+		return NGX_OK;
+	}
+
+	static ngx_int_t ngx_http_lmdb_queue_add_stats_zone(ngx_conf_t *cf) {
+		statsCtx = NULL;
+		if (producers.empty()) {
+			return NGX_OK;
+		}
+
+		StatsCtx *ctx = (StatsCtx*)ngx_pcalloc(cf->pool, sizeof(StatsCtx));
+		if (ctx == NULL) {
+			return NGX_ERROR;
+		}
+		ctx->count = producers.size();
+
+		static ngx_str_t zoneName = ngx_string("lmdb_queue_stats");
+		ngx_shm_zone_t *zone = ngx_shared_memory_add(cf, &zoneName, ctx->count * sizeof(StatsSlot) + 64 * 1024, &ngx_http_lmdb_queue_module);
+		if (zone == NULL) {
+			return NGX_ERROR;
+		}
+
+		zone->init = ngx_http_lmdb_queue_init_stats_zone;
+		zone->data = ctx;
+		statsCtx = ctx;
+		return NGX_OK;
+	}
+
 	static ngx_int_t ngx_http_lmdb_queue_handler_init(ngx_conf_t *cf) {
+		if (ngx_http_lmdb_queue_add_stats_zone(cf) != NGX_OK) {
+			return NGX_ERROR;
+		}
+
 		ngx_http_core_main_conf_t *cmcf = (ngx_http_core_main_conf_t*)ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
 		ngx_http_handler_pt *h = (ngx_http_handler_pt*)ngx_array_push(&cmcf->phases[NGX_HTTP_LOG_PHASE].handlers);
 		if (h == NULL) {
@@ -237,56 +776,561 @@ extern "C" {
 		return NGX_OK;	
 	}
 	
+	static size_t ngx_http_lmdb_queue_body_len(ngx_http_request_t *r) {
+		if (r->request_body == NULL) {
+			return 0;
+		}
+
+		size_t len = 0;
+		for (ngx_chain_t *cl = r->request_body->bufs; cl; cl = cl->next) {
+			len += size_t(ngx_buf_size(cl->buf));
+		}
+
+		return len;
+	}
+
+	/* NULL when a spooled part cannot be read back, the record must not be stored then. */
+	static u_char *ngx_http_lmdb_queue_render_body(ngx_http_request_t *r, u_char *cur) {
+		if (r->request_body == NULL) {
+			return cur;
+		}
+
+		for (ngx_chain_t *cl = r->request_body->bufs; cl; cl = cl->next) {
+			ngx_buf_t *b = cl->buf;
+			if (ngx_buf_in_memory(b)) {
+				cur = ngx_cpymem(cur, b->pos, size_t(b->last - b->pos));
+				continue;
+			}
+
+			if (b->in_file && b->file) {
+				/* Spooled to client_body_temp: read straight into the record. */
+				size_t size = size_t(b->file_last - b->file_pos);
+				ssize_t n = ngx_read_file(b->file, cur, size, b->file_pos);
+				if (n != ssize_t(size)) {
+					ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "lmdb_queue: Read request body from \"%V\" failed, record dropped.", &b->file->name);
+					return NULL;
+				}
+
+				cur += size;
+			}
+		}
+
+		return cur;
+	}
+
+	static u_char *ngx_http_lmdb_queue_render(ngx_http_request_t *r, ngx_http_lmdb_queue_loc_conf *lcf, ngx_http_variable_value_t **vals, u_char *cur) {
+		ngx_http_lmdb_queue_op *op, *opEnd = lcf->ops + lcf->ops_count;
+		for (op = lcf->ops; op < opEnd; ++op) {
+			switch (op->type) {
+			case NGX_HTTP_LMDB_QUEUE_OP_LITERAL:
+				cur = ngx_cpymem(cur, op->data, op->len);
+				break;
+			case NGX_HTTP_LMDB_QUEUE_OP_VARIABLE: {
+				ngx_http_variable_value_t *v = *vals++;
+				if (v) cur = ngx_cpymem(cur, v->data, v->len);
+				break;
+			}
+			case NGX_HTTP_LMDB_QUEUE_OP_BODY:
+				cur = ngx_http_lmdb_queue_render_body(r, cur);
+				if (cur == NULL) {
+					return NULL;
+				}
+				break;
+			}
+		}
+
+		return cur;
+	}
+
+	static bool ngx_http_lmdb_queue_should_push(ngx_http_request_t *r, ngx_http_lmdb_queue_loc_conf *lcf) {
+		if (lcf->if_index != NGX_ERROR) {
+			ngx_http_variable_value_t *v = ngx_http_get_indexed_variable(r, lcf->if_index);
+			if (v == NULL || v->not_found || v->len == 0 || (v->len == 1 && v->data[0] == '0')) {
+				return false;
+			}
+		}
+
+		if (lcf->sample >= 10000) {
+			return true;
+		}
+
+		if (lcf->sample_key_index != NGX_ERROR) {
+			/* Same key, same decision: all events of a session are kept or dropped together. */
+			ngx_http_variable_value_t *v = ngx_http_get_indexed_variable(r, lcf->sample_key_index);
+			if (v && !v->not_found) {
+				return ngx_murmur_hash2(v->data, v->len) % 10000 < lcf->sample;
+			}
+		}
+
+		return ngx_uint_t(ngx_random()) % 10000 < lcf->sample;
+	}
+
 	static ngx_int_t ngx_http_lmdb_queue_handler(ngx_http_request_t *r) {
 		ngx_http_lmdb_queue_loc_conf *lcf = (ngx_http_lmdb_queue_loc_conf*)ngx_http_get_module_loc_conf(r, ngx_http_lmdb_queue_module);
-		if (lcf->producer == NULL) {
+		if (lcf->producer == NULL || !ngx_http_lmdb_queue_should_push(r, lcf)) {
 			return NGX_OK;
 		}
 		
-		std::vector<ngx_http_variable_value_t*> vals;
-		size_t resLen = lcf->data_format_len;
-		for (size_t i = 0; i < lcf->vars_count; ++i) {
-			ngx_http_variable_value_t *v = ngx_http_get_indexed_variable(r, lcf->vars[i]);
-			vals.push_back(v);
-			
-			if (v && !v->not_found) {
-				resLen += (v->len - 1);
-			} else {
-				--resLen;
+		/* Evaluate every variable once to size the record, then copy whole spans. */
+		ngx_http_variable_value_t **vals = NULL;
+		if (lcf->vars_count > 0) {
+			vals = (ngx_http_variable_value_t**)ngx_palloc(r->pool, lcf->vars_count * sizeof(ngx_http_variable_value_t*));
+			if (vals == NULL) {
+				return NGX_ERROR;
 			}
 		}
-		
-		Producer::ItemType item = Producer::ItemType::create(resLen);
-		u_char *formatCur = lcf->data_format, *formatEnd = lcf->data_format + lcf->data_format_len;
-		u_char *cur = (u_char*)item.data();
-		auto valIter = vals.begin();
-		while (formatCur < formatEnd) {
-			if (*formatCur != '\1') {
-				*cur++ = *formatCur++;
-			} else {
-				++formatCur;
-				ngx_http_variable_value_t *v = *valIter++;
-				if (v && !v->not_found) {
-					for (u_char *src = v->data; src < v->data + v->len;) {
-						*cur++ = *src++;
-					}
+
+		size_t resLen = lcf->literal_len;
+		ngx_http_lmdb_queue_op *op, *opEnd = lcf->ops + lcf->ops_count;
+		ngx_http_variable_value_t **val = vals;
+		for (op = lcf->ops; op < opEnd; ++op) {
+			if (op->type == NGX_HTTP_LMDB_QUEUE_OP_VARIABLE) {
+				ngx_http_variable_value_t *v = ngx_http_get_indexed_variable(r, op->index);
+				if (v && v->not_found) v = NULL;
+				if (v) resLen += v->len;
+				*val++ = v;
+			} else if (op->type == NGX_HTTP_LMDB_QUEUE_OP_BODY) {
+				resLen += ngx_http_lmdb_queue_body_len(r);
+			}
+		}
+
+		if (lcf->ring && lcf->ring->ring) {
+			/* Shared ring: render in place, the elected writer moves it into LMDB. Full ring falls through. */
+			uint64_t pos;
+			u_char *dst = (u_char*)lcf->ring->ring->reserve(resLen, pos);
+			if (dst) {
+				if (ngx_http_lmdb_queue_render(r, lcf, vals, dst)) {
+					lcf->ring->ring->commit(pos);
+				} else {
+					lcf->ring->ring->discard(pos);
 				}
+				return NGX_OK;
 			}
 		}
 
+		/* Large records reuse pooled blocks. Either way the flush thread copies the item into its reserved LMDB value. */
+		bool large = lcf->direct_min > 0 && resLen >= lcf->direct_min;
+		Producer::ItemType item = large ? Producer::ItemType::pooled(resLen) : Producer::ItemType::create(resLen);
+		if (ngx_http_lmdb_queue_render(r, lcf, vals, (u_char*)item.data()) == NULL) {
+			return NGX_OK;
+		}
+
 		lcf->producer->push2Cache(std::move(item));
 		return NGX_OK;
 	}
 	
+	static ngx_int_t ngx_http_lmdb_queue_split_frames(ngx_http_lmdb_queue_loc_conf *lcf, u_char *data, size_t len, std::vector<std::pair<u_char*, size_t> >& frames) {
+		u_char *cur = data, *end = data + len;
+
+		if (lcf->ingest_framing == NGX_HTTP_LMDB_QUEUE_FRAMING_NEWLINE) {
+			while (cur < end) {
+				u_char *eol = (u_char*)memchr(cur, '\n', size_t(end - cur));
+				u_char *last = eol ? eol : end;
+				if (last > cur && *(last - 1) == '\r') --last;
+				if (last > cur) frames.push_back(std::make_pair(cur, size_t(last - cur)));
+				cur = eol ? eol + 1 : end;
+			}
+
+			return NGX_OK;
+		}
+
+		while (cur < end) {
+			if (end - cur < 4) {
+				return NGX_ERROR;
+			}
+
+			size_t frameLen = (size_t(cur[0]) << 24) | (size_t(cur[1]) << 16) | (size_t(cur[2]) << 8) | size_t(cur[3]);
+			cur += 4;
+			if (frameLen > size_t(end - cur)) {
+				return NGX_ERROR;
+			}
+
+			frames.push_back(std::make_pair(cur, frameLen));
+			cur += frameLen;
+		}
+
+		return NGX_OK;
+	}
+
+	static void ngx_http_lmdb_queue_ingest_body(ngx_http_request_t *r) {
+		ngx_http_lmdb_queue_loc_conf *lcf = (ngx_http_lmdb_queue_loc_conf*)ngx_http_get_module_loc_conf(r, ngx_http_lmdb_queue_module);
+
+		/* A body kept in one memory buffer is framed in place, otherwise it is gathered once. */
+		u_char *data = NULL;
+		size_t len = ngx_http_lmdb_queue_body_len(r);
+		ngx_chain_t *bufs = r->request_body ? r->request_body->bufs : NULL;
+		if (bufs && bufs->next == NULL && ngx_buf_in_memory(bufs->buf)) {
+			data = bufs->buf->pos;
+		} else if (len > 0) {
+			data = (u_char*)ngx_pnalloc(r->pool, len);
+			if (data == NULL) {
+				ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+				return;
+			}
+
+			if (ngx_http_lmdb_queue_render_body(r, data) == NULL) {
+				ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+				return;
+			}
+		}
+
+		std::vector<std::pair<u_char*, size_t> > frames;
+		if (ngx_http_lmdb_queue_split_frames(lcf, data, len, frames) != NGX_OK) {
+			ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "lmdb_queue: Truncated frame in ingest body.");
+			ngx_http_finalize_request(r, NGX_HTTP_BAD_REQUEST);
+			return;
+		}
+
+		/* One transaction for the whole batch, each frame rendered straight into its reserved slot. */
+		if (!frames.empty() && !lcf->ingest_producer->pushReserved(frames.size(),
+			[&frames](size_t i) { return frames[i].second; },
+			[&frames](size_t i, char* dst) { ngx_memcpy(dst, frames[i].first, frames[i].second); })) {
+			ngx_http_finalize_request(r, NGX_HTTP_INSUFFICIENT_STORAGE);
+			return;
+		}
+
+		ngx_http_finalize_request(r, NGX_HTTP_NO_CONTENT);
+	}
+
+	static ngx_int_t ngx_http_lmdb_queue_ingest_handler(ngx_http_request_t *r) {
+		if (!(r->method & (NGX_HTTP_POST | NGX_HTTP_PUT))) {
+			return NGX_HTTP_NOT_ALLOWED;
+		}
+
+		ngx_int_t rc = ngx_http_read_client_request_body(r, ngx_http_lmdb_queue_ingest_body);
+		if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
+			return rc;
+		}
+
+		return NGX_DONE;
+	}
+
+	static std::string ngx_http_lmdb_queue_escape(const std::string& str) {
+		std::string ret;
+		for (char c : str) {
+			if (c == '"' || c == '\\') {
+				ret += '\\';
+				ret += c;
+			} else if ((unsigned char)c < 0x20) {
+				char hex[8];
+				snprintf(hex, sizeof(hex), "\\u%04x", c);
+				ret += hex;
+			} else {
+				ret += c;
+			}
+		}
+
+		return ret;
+	}
+
+	typedef std::vector<std::pair<std::string, TopicStatus> > ngx_http_lmdb_queue_statuses;
+
+	static double ngx_http_lmdb_queue_chunk_fill(const ChunkStatus& chunk) {
+		return chunk.mapSize ? double(chunk.pagesUsed) * chunk.pageSize / chunk.mapSize : 0;
+	}
+
+	static uint64_t ngx_http_lmdb_queue_lag(const TopicStatus& st, uint64_t consumerHead) {
+		/* Consumer heads point at the next message to read, the producer head at the last one written. */
+		return st.producerHead + 1 > consumerHead ? st.producerHead + 1 - consumerHead : 0;
+	}
+
+	static const struct {
+		const char *name;
+		std::atomic<uint64_t> ProducerStats::*field;
+	} ngx_http_lmdb_queue_counters[] = {
+		{ "pushes", &ProducerStats::pushes },
+		{ "bytes", &ProducerStats::bytes },
+		{ "stored_bytes", &ProducerStats::storedBytes },
+		{ "blob_bytes", &ProducerStats::blobBytes },
+		{ "flushes", &ProducerStats::flushes },
+		{ "map_full_retries", &ProducerStats::mapFullRetries },
+		{ "rotations", &ProducerStats::rotations },
+		{ "prepared_rotations", &ProducerStats::preparedRotations },
+		{ "split_batches", &ProducerStats::splitBatches },
+		{ "dropped", &ProducerStats::dropped },
+		{ "spilled", &ProducerStats::spilled },
+		{ "spill_recovered", &ProducerStats::spillRecovered },
+		{ "blocked", &ProducerStats::blocked },
+		{ "reaped_chunks", &ProducerStats::reapedChunks },
+		{ "reclaimed_bytes", &ProducerStats::reclaimedBytes },
+		{ "low_disk_trims", &ProducerStats::lowDiskTrims }
+	};
+
+	static const struct {
+		const char *name;
+		std::atomic<int64_t> ProducerStats::*field;
+	} ngx_http_lmdb_queue_gauges[] = {
+		{ "cache_depth", &ProducerStats::cacheDepth },
+		{ "reap_pending_bytes", &ProducerStats::reapPendingBytes }
+	};
+
+	static const struct {
+		const char *name;
+		LatencyHistogram ProducerStats::*field;
+	} ngx_http_lmdb_queue_histograms[] = {
+		{ "cache_wait", &ProducerStats::cacheWait },
+		{ "txn_build", &ProducerStats::txnBuild },
+		{ "commit", &ProducerStats::commit },
+		{ "rotate", &ProducerStats::rotate },
+		{ "sync", &ProducerStats::sync }
+	};
+
+	static void ngx_http_lmdb_queue_stats_json(std::ostringstream& out) {
+		out << ",\"stats\":{";
+
+		size_t t = 0;
+		for (auto& producer : producers) {
+			StatsSlot *slot = ngx_http_lmdb_queue_stats_slot(producer.first);
+			if (slot == NULL) continue;
+
+			out << (t++ ? "," : "") << "\"" << ngx_http_lmdb_queue_escape(producer.first) << "\":{";
+			for (auto& counter : ngx_http_lmdb_queue_counters) {
+				out << "\"" << counter.name << "\":" << (slot->stats.*counter.field).load(std::memory_order_relaxed) << ",";
+			}
+			size_t g = 0;
+			for (auto& gauge : ngx_http_lmdb_queue_gauges) {
+				out << (g++ ? "," : "") << "\"" << gauge.name << "\":" << (slot->stats.*gauge.field).load(std::memory_order_relaxed);
+			}
+
+			auto ring = rings.find(producer.first);
+			if (ring != rings.end() && ring->second->ring) {
+				Ring *rb = ring->second->ring;
+				out << ",\"ring\":{\"capacity\":" << rb->capacity() << ",\"used\":" << rb->used()
+					<< ",\"full\":" << rb->fullCount() << ",\"abandoned\":" << rb->abandonedCount() << "}";
+			}
+
+			out << ",\"latency_us\":{";
+			size_t h = 0;
+			for (auto& histogram : ngx_http_lmdb_queue_histograms) {
+				LatencyHistogram& hist = slot->stats.*histogram.field;
+				out << (h++ ? "," : "") << "\"" << histogram.name << "\":{\"count\":" << hist.count.load(std::memory_order_relaxed)
+					<< ",\"sum\":" << hist.sumUs.load(std::memory_order_relaxed) << ",\"buckets\":[";
+				for (size_t i = 0; i < LatencyHistogram::bucketCount; ++i) {
+					out << (i ? "," : "") << hist.buckets[i].load(std::memory_order_relaxed);
+				}
+				out << "]}";
+			}
+			out << "}}";
+		}
+
+		out << "}";
+	}
+
+	static void ngx_http_lmdb_queue_stats_prometheus(std::ostringstream& out) {
+		for (auto& counter : ngx_http_lmdb_queue_counters) {
+			out << "# TYPE lmdb_queue_" << counter.name << "_total counter\n";
+			for (auto& producer : producers) {
+				StatsSlot *slot = ngx_http_lmdb_queue_stats_slot(producer.first);
+				if (slot == NULL) continue;
+				out << "lmdb_queue_" << counter.name << "_total{topic=\"" << ngx_http_lmdb_queue_escape(producer.first) << "\"} " << (slot->stats.*counter.field).load(std::memory_order_relaxed) << "\n";
+			}
+		}
+
+		for (auto& gauge : ngx_http_lmdb_queue_gauges) {
+			out << "# TYPE lmdb_queue_" << gauge.name << " gauge\n";
+			for (auto& producer : producers) {
+				StatsSlot *slot = ngx_http_lmdb_queue_stats_slot(producer.first);
+				if (slot == NULL) continue;
+				out << "lmdb_queue_" << gauge.name << "{topic=\"" << ngx_http_lmdb_queue_escape(producer.first) << "\"} " << (slot->stats.*gauge.field).load(std::memory_order_relaxed) << "\n";
+			}
+		}
+
+		for (auto& histogram : ngx_http_lmdb_queue_histograms) {
+			out << "# TYPE lmdb_queue_" << histogram.name << "_microseconds histogram\n";
+			for (auto& producer : producers) {
+				StatsSlot *slot = ngx_http_lmdb_queue_stats_slot(producer.first);
+				if (slot == NULL) continue;
+
+				/* Bucket i holds samples below 2^i us, i.e. up to 2^i - 1 in whole microseconds. */
+				LatencyHistogram& hist = slot->stats.*histogram.field;
+				std::string labels = "topic=\"" + ngx_http_lmdb_queue_escape(producer.first) + "\"";
+				uint64_t cumulative = 0;
+				for (size_t i = 0; i < LatencyHistogram::bucketCount - 1; ++i) {
+					cumulative += hist.buckets[i].load(std::memory_order_relaxed);
+					out << "lmdb_queue_" << histogram.name << "_microseconds_bucket{" << labels << ",le=\"" << ((uint64_t(1) << i) - 1) << "\"} " << cumulative << "\n";
+				}
+				cumulative += hist.buckets[LatencyHistogram::bucketCount - 1].load(std::memory_order_relaxed);
+				out << "lmdb_queue_" << histogram.name << "_microseconds_bucket{" << labels << ",le=\"+Inf\"} " << cumulative << "\n";
+				out << "lmdb_queue_" << histogram.name << "_microseconds_sum{" << labels << "} " << hist.sumUs.load(std::memory_order_relaxed) << "\n";
+				out << "lmdb_queue_" << histogram.name << "_microseconds_count{" << labels << "} " << hist.count.load(std::memory_order_relaxed) << "\n";
+			}
+		}
+	}
+
+	static void ngx_http_lmdb_queue_status_json(std::ostringstream& out, const ngx_http_lmdb_queue_statuses& statuses) {
+		out << "{\"topics\":{";
+		for (size_t t = 0; t < statuses.size(); ++t) {
+			const TopicStatus& st = statuses[t].second;
+			out << (t ? "," : "") << "\"" << ngx_http_lmdb_queue_escape(statuses[t].first) << "\":{";
+			out << "\"producer_head\":" << st.producerHead << ",\"consumers\":{";
+
+			size_t i = 0;
+			for (auto& consumer : st.consumerHeads) {
+				out << (i++ ? "," : "") << "\"" << ngx_http_lmdb_queue_escape(consumer.first) << "\":{\"head\":" << consumer.second
+					<< ",\"lag\":" << ngx_http_lmdb_queue_lag(st, consumer.second) << "}";
+			}
+
+			out << "},\"partitions\":[";
+			for (i = 0; i < st.partitions.size(); ++i) {
+				out << (i ? "," : "") << st.partitions[i];
+			}
+
+			out << "],\"chunk_count\":" << st.chunks.size() << ",\"chunks\":[";
+			for (i = 0; i < st.chunks.size(); ++i) {
+				const ChunkStatus& chunk = st.chunks[i];
+				out << (i ? "," : "") << "{\"file\":" << chunk.file << ",\"first_seq\":" << chunk.firstSeq << ",\"entries\":" << chunk.entries
+					<< ",\"page_size\":" << chunk.pageSize << ",\"pages_used\":" << chunk.pagesUsed << ",\"map_size\":" << chunk.mapSize
+					<< ",\"fill\":" << ngx_http_lmdb_queue_chunk_fill(chunk) << ",\"disk_bytes\":" << chunk.diskBytes
+					<< ",\"created_ms\":" << chunk.createdMs << ",\"closed_ms\":" << chunk.closedMs
+					<< ",\"min_ms\":" << chunk.minMs << ",\"max_ms\":" << chunk.maxMs << "}";
+			}
+
+			out << "]}";
+		}
+
+		out << "}";
+		ngx_http_lmdb_queue_stats_json(out);
+		out << "}";
+	}
+
+	static void ngx_http_lmdb_queue_status_prometheus(std::ostringstream& out, const ngx_http_lmdb_queue_statuses& statuses) {
+		out.precision(17); // Byte counts are printed as doubles, keep them exact.
+		out << "# TYPE lmdb_queue_producer_head gauge\n";
+		for (auto& topic : statuses) {
+			out << "lmdb_queue_producer_head{topic=\"" << ngx_http_lmdb_queue_escape(topic.first) << "\"} " << topic.second.producerHead << "\n";
+		}
+
+		out << "# TYPE lmdb_queue_consumer_head gauge\n";
+		for (auto& topic : statuses) {
+			for (auto& consumer : topic.second.consumerHeads) {
+				out << "lmdb_queue_consumer_head{topic=\"" << ngx_http_lmdb_queue_escape(topic.first) << "\",consumer=\"" << ngx_http_lmdb_queue_escape(consumer.first) << "\"} " << consumer.second << "\n";
+			}
+		}
+
+		out << "# TYPE lmdb_queue_consumer_lag gauge\n";
+		for (auto& topic : statuses) {
+			for (auto& consumer : topic.second.consumerHeads) {
+				out << "lmdb_queue_consumer_lag{topic=\"" << ngx_http_lmdb_queue_escape(topic.first) << "\",consumer=\"" << ngx_http_lmdb_queue_escape(consumer.first) << "\"} " << ngx_http_lmdb_queue_lag(topic.second, consumer.second) << "\n";
+			}
+		}
+
+		out << "# TYPE lmdb_queue_chunks gauge\n";
+		for (auto& topic : statuses) {
+			out << "lmdb_queue_chunks{topic=\"" << ngx_http_lmdb_queue_escape(topic.first) << "\"} " << topic.second.chunks.size() << "\n";
+		}
+
+		struct {
+			const char* name;
+			std::function<double(const ChunkStatus&)> value;
+		} chunkMetrics[] = {
+			{ "lmdb_queue_chunk_entries", [](const ChunkStatus& c) { return double(c.entries); } },
+			{ "lmdb_queue_chunk_pages_used", [](const ChunkStatus& c) { return double(c.pagesUsed); } },
+			{ "lmdb_queue_chunk_map_bytes", [](const ChunkStatus& c) { return double(c.mapSize); } },
+			{ "lmdb_queue_chunk_fill_ratio", ngx_http_lmdb_queue_chunk_fill },
+			{ "lmdb_queue_chunk_disk_bytes", [](const ChunkStatus& c) { return double(c.diskBytes); } }
+		};
+
+		for (auto& metric : chunkMetrics) {
+			out << "# TYPE " << metric.name << " gauge\n";
+			for (auto& topic : statuses) {
+				for (auto& chunk : topic.second.chunks) {
+					out << metric.name << "{topic=\"" << ngx_http_lmdb_queue_escape(topic.first) << "\",chunk=\"" << chunk.file << "\"} " << metric.value(chunk) << "\n";
+				}
+			}
+		}
+
+		ngx_http_lmdb_queue_stats_prometheus(out);
+	}
+
+	static ngx_int_t ngx_http_lmdb_queue_send(ngx_http_request_t *r, const std::string& body, const char *contentType) {
+		r->headers_out.status = NGX_HTTP_OK;
+		r->headers_out.content_length_n = off_t(body.size());
+		r->headers_out.content_type.len = strlen(contentType);
+		r->headers_out.content_type.data = (u_char*)contentType;
+		r->headers_out.content_type_len = r->headers_out.content_type.len;
+
+		ngx_int_t rc = ngx_http_send_header(r);
+		if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+			return rc;
+		}
+
+		ngx_buf_t *b = ngx_create_temp_buf(r->pool, body.size() + 1);
+		if (b == NULL) {
+			return NGX_HTTP_INTERNAL_SERVER_ERROR;
+		}
+
+		b->last = ngx_cpymem(b->last, body.data(), body.size());
+		b->last_buf = 1;
+		b->last_in_chain = 1;
+
+		ngx_chain_t out { b, NULL };
+		return ngx_http_output_filter(r, &out);
+	}
+
+	static ngx_int_t ngx_http_lmdb_queue_status_handler(ngx_http_request_t *r) {
+		if (!(r->method & (NGX_HTTP_GET | NGX_HTTP_HEAD))) {
+			return NGX_HTTP_NOT_ALLOWED;
+		}
+
+		ngx_int_t rc = ngx_http_discard_request_body(r);
+		if (rc != NGX_OK) {
+			return rc;
+		}
+
+		/* Everything is read through read-only transactions, producers are never stalled. */
+		ngx_http_lmdb_queue_statuses statuses;
+		for (auto& producer : producers) {
+			Topic *topic = EnvManager::getEnv(queue_path)->getTopic(producer.first);
+			statuses.push_back(std::make_pair(producer.first, topic->status()));
+
+			std::vector<uint32_t> partitions = statuses.back().second.partitions;
+			for (uint32_t id : partitions) {
+				Topic *partition = topic->getPartition(id);
+				statuses.push_back(std::make_pair(partition->getName(), partition->status()));
+			}
+		}
+
+		ngx_str_t format;
+		bool prometheus = ngx_http_arg(r, (u_char*)"format", 6, &format) == NGX_OK
+			&& format.len == 10 && ngx_strncmp(format.data, "prometheus", 10) == 0;
+
+		std::ostringstream out;
+		if (prometheus) {
+			ngx_http_lmdb_queue_status_prometheus(out, statuses);
+			return ngx_http_lmdb_queue_send(r, out.str(), "text/plain; version=0.0.4");
+		}
+
+		ngx_http_lmdb_queue_status_json(out, statuses);
+		return ngx_http_lmdb_queue_send(r, out.str(), "application/json");
+	}
+
 	ngx_int_t lmdb_queue_on_init_process(ngx_cycle_t*) {
+		/* The meta envs were opened by the master, producers read them on every push. */
+		EnvManager::afterFork();
+
 		for (auto &producer : producers) {
+			if (producer.second->isPartitioned()) {
+				producer.second->partition(ngx_worker);
+			}
+
+			StatsSlot *slot = ngx_http_lmdb_queue_stats_slot(producer.first);
+			producer.second->setStats(slot ? &slot->stats : NULL);
 			producer.second->enableBackgroundFlush();
 		}
 
+		/* Every worker runs a writer, only the one owning a ring drains it. */
+		for (auto &ring : rings) {
+			auto producerIter = producers.find(ring.first);
+			if (ring.second->ring && producerIter != producers.end()) {
+				ringWriters.emplace_back(new RingWriter(ring.second->ring, producerIter->second.get()));
+			}
+		}
+
 		return NGX_OK;
 	}
 	
 	void lmdb_queue_on_exit_process(ngx_cycle_t*) {
+		ringWriters.clear();
 		producers.clear();
 	}
 }
\ No newline at end of file
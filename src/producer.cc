@@ -3,39 +3,146 @@
 #endif
 
 #include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#ifdef __linux__
+#include <fcntl.h>
+#endif
+#ifndef _WIN32
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#endif
 #include <iostream>
+#include <algorithm>
+#include <map>
 
+#include <lz4.h>
 #include "topic.h"
 #include "producer.h"
+#include "reaper.h"
+#include "batch.h"
 
 using namespace std;
 
+size_t Producer::_memoryBudget = 0;
+atomic<size_t> Producer::_memoryUsed(0);
+
+/*
+ * Free blocks of ItemType::pooled() by power of two size class. Large blocks come straight from
+ * mmap and go back with munmap, with page faults on every first touch; reused ones do not.
+ */
+static mutex poolMtx;
+static size_t poolBytes = 0;
+static const size_t poolMinBlock = 4096, poolMaxBytes = 64 * 1024 * 1024;
+
+static map<size_t, vector<char*> >& pool() {
+    /* Never destroyed: items of static producers are handed back during exit. */
+    static map<size_t, vector<char*> >* blocks = new map<size_t, vector<char*> >();
+    return *blocks;
+}
+
 Producer::ItemType Producer::ItemType::create(size_t len) {
     ItemType ret(new char[len], len);
     ret._shouldDelete = true;
     return std::move(ret);
 }
 
-Producer::ItemType::~ItemType() {
-    if (_shouldDelete) {
-        delete _mem;
+Producer::ItemType Producer::ItemType::pooled(size_t len) {
+    size_t cap = poolMinBlock;
+    while (cap < len) cap <<= 1;
+
+    char* mem = nullptr;
+    {
+        std::lock_guard<std::mutex> guard(poolMtx);
+        auto it = pool().find(cap);
+        if (it != pool().end() && !it->second.empty()) {
+            mem = it->second.back();
+            it->second.pop_back();
+            poolBytes -= cap;
+        }
     }
+
+    ItemType ret(mem ? mem : new char[cap], len);
+    ret._cap = cap;
+    ret._shouldDelete = true;
+    return std::move(ret);
+}
+
+void Producer::ItemType::release() {
+    if (_cap) {
+        std::lock_guard<std::mutex> guard(poolMtx);
+        if (poolBytes + _cap <= poolMaxBytes) {
+            pool()[_cap].push_back(_mem);
+            poolBytes += _cap;
+            return;
+        }
+    }
+
+    if (_shouldDelete) delete[] _mem;
 }
 
-Producer::Producer(const string& root, const string& topic, TopicOpt* opt, size_t cacheMax) : _topic(EnvManager::getEnv(root)->getTopic(topic)), _current(-1), _env(nullptr), _db(0), _bgEnabled(false), _bgRunning(false), _cacheMax(cacheMax), _cacheCurrent(&_cache0) {
+Producer::ItemType& Producer::ItemType::operator=(ItemType&& r) {
+    if (this != &r) {
+        release();
+
+        _mem = r._mem;
+        _len = r._len;
+        _cap = r._cap;
+        _shouldDelete = r._shouldDelete;
+
+        r._mem = nullptr;
+        r._len = 0;
+        r._cap = 0;
+        r._shouldDelete = false;
+    }
+
+    return *this;
+}
+
+Producer::ItemType::~ItemType() {
+    release();
+}
+
+Producer::Producer(const string& root, const string& topic, TopicOpt* opt, size_t cacheMax) : _topic(EnvManager::getEnv(root)->getTopic(topic)), _current(-1), _env(nullptr), _db(0), _format{ false, COMPRESSION_NONE, false, false }, _nextFile(0), _nextEnv(nullptr), _nextDb(0), _nextFormat{ false, COMPRESSION_NONE, false, false }, _pageSize(4096), _syncRunning(false), _firstSeq(0), _head(0), _checkpointed(0), _chunkCreatedMs(0), _chunkMinMs(0), _chunkMaxMs(0), _indexMs(0), _indexSeq(0), _bgEnabled(false), _bgRunning(false), _cacheMax(cacheMax), _cacheSize(0), _cacheBytes(0), _flushRequested(false), _cache(cacheCapacity(opt, cacheMax)), _stats(nullptr), _blobFile(nullptr), _blobChunk(0), _overflow(OVERFLOW_BLOCK), _highWater(0), _overflowWait(100), _spillFile(nullptr), _replayFile(nullptr), _spillCount(0), _orphansChecked(false) {
     if (opt) {
         _opt = *opt;
     } else {
         /* Default opt */
         _opt.chunkSize = 1024 * 1024 * 1024;
         _opt.chunksToKeep = 8;
+        _opt.partitioned = false;
+        _opt.flushTargetUs = 0;
+        _opt.durability = DURABILITY_NONE;
+        _opt.syncIntervalMs = 0;
+        _opt.batched = false;
+        _opt.compression = COMPRESSION_NONE;
+        _opt.blobThreshold = 0;
+        _opt.maxAgeMs = 0;
+        _opt.maxBytes = 0;
+        _opt.rotateIntervalMs = 0;
+        _opt.minFreeBytes = 0;
     }
 
-    Txn txn(_topic->getEnv(), NULL);
-    openHead(&txn);
-    txn.commit();
+    if (_opt.compression != COMPRESSION_NONE || _opt.blobThreshold) _opt.batched = true;
+
+    if (_opt.flushTargetUs) {
+        /* The byte budget decides when to flush, the item count only guards the queue capacity. */
+        _cacheMax = _cache.capacity() / 2;
+        _flushCtl.reset(new FlushController(chrono::microseconds(_opt.flushTargetUs), chrono::milliseconds(200)));
+    }
 
-    _cache0.reserve(_cacheMax);
+    /* A partitioned producer opens its chunk series in partition(). */
+    if (!_opt.partitioned) {
+        openHead();
+    }
+
+    _flushBatch.reserve(cacheMax);
+}
+
+size_t Producer::cacheCapacity(const TopicOpt* opt, size_t cacheMax) {
+    return opt && opt->flushTargetUs ? 65536 : max<size_t>(cacheMax * 16, 4096);
 }
 
 Producer::~Producer() {
@@ -46,11 +153,44 @@ Producer::~Producer() {
             _bgCv.notify_one();
         }
         _bgFlush.join();
-    } else {
-        flush();
     }
 
+    drainCache();
+
+    if (_syncThread.joinable()) {
+        {
+            unique_lock<mutex> lck(_syncMtx);
+            _syncRunning = false;
+            _syncCv.notify_one();
+        }
+        _syncThread.join();
+    }
+
+    checkpoint();
     closeCurrent();
+
+    /* An unused prepared chunk stays on disk, the rotation to it opens the file again. */
+    _current = -1;
+    adoptPrepared();
+
+    if (_spillFile) {
+        fclose(_spillFile);
+        if (_spillCount == 0) remove(_spillPath.c_str());
+    }
+    /* Records left in the spill or replay file go to the next producer of the topic, see replayOrphanedSpills(). */
+    if (_replayFile) fclose(_replayFile);
+}
+
+bool Producer::partition(uint32_t id) {
+    if (!_opt.partitioned || _env) {
+        cout << "LMDB_QUEUE WARNING: Producer of topic '" << _topic->getName() << "' cannot be partitioned." << endl;
+        return false;
+    }
+
+    /* The partition's chunks have a single writer, so its LMDB write lock is never contended. */
+    _topic = _topic->getPartition(id);
+    openHead();
+    return _env != nullptr;
 }
 
 bool Producer::enableBackgroundFlush(chrono::milliseconds flushInterval) {
@@ -62,8 +202,10 @@ bool Producer::enableBackgroundFlush(chrono::milliseconds flushInterval) {
 
         _bgEnabled = true;
         _bgRunning = true;
-        _cache1.reserve(_cacheMax);
         _flushInterval = flushInterval;
+        if (_flushCtl) {
+            _flushCtl.reset(new FlushController(chrono::microseconds(_opt.flushTargetUs), flushInterval));
+        }
         _bgFlush = thread(bind(&Producer::flushWorker, this));
         return true;
     } else {
@@ -73,161 +215,1100 @@ bool Producer::enableBackgroundFlush(chrono::milliseconds flushInterval) {
 }
 
 bool Producer::push(const Producer::BatchType& batch) {
-    bool isFull = false;
+    return pushReserved(batch.size(),
+        [&batch](size_t i) { return batch[i].len(); },
+        [&batch](size_t i, char* dst) { memcpy(dst, batch[i].data(), batch[i].len()); });
+}
 
-    {
-        Txn txn(_topic->getEnv(), _env);
-
-        uint64_t head = _topic->getProducerHead(txn);
-        for (auto& item : batch) {
-            MDB_val key{ sizeof(head), &++head },
-                    val{ item.len(), (void*)item.data() };
-
-            int rc = mdb_put(txn.getTxn(), _db, &key, &val, MDB_APPEND);
-            if (rc == MDB_MAP_FULL) {
-                txn.abort();
-                isFull = true;
-                break;
+bool Producer::pushReserved(size_t count, const LengthFn& lenOf, const RenderFn& render, size_t* pushed) {
+    std::lock_guard<std::mutex> guard(_writeMtx);
+    return pushImpl(count, lenOf, render, nullptr, pushed);
+}
+
+bool Producer::pushImpl(size_t count, const LengthFn& lenOf, const RenderFn& render, uint64_t* commitUs, size_t* pushed) {
+    size_t done = 0;
+    if (pushed) *pushed = 0;
+    while (done < count) {
+        /* What is left of a batch split at a chunk boundary. */
+        LengthFn restLen = [&](size_t i) { return lenOf(done + i); };
+        RenderFn restRender = [&](size_t i, char* dst) { render(done + i, dst); };
+        const LengthFn& len = done ? restLen : lenOf;
+        const RenderFn& rnd = done ? restRender : render;
+
+        size_t part = count - done;
+        if (_opt.compression != COMPRESSION_NONE && _opt.blobThreshold) {
+            /* A blob goes to a part of its own, the messages around it compress without it. */
+            part = 0;
+            while (part < count - done && !isBlob(len(part))) ++part;
+            if (part == 0) part = 1;
+        }
+
+        /* Compressed once per part and outside of the chunk write lock. */
+        _zipped.clear();
+        if (_opt.compression != COMPRESSION_NONE && !isBlob(len(0))) compressBatch(part, len, rnd);
+
+        size_t written;
+        if (!writeBatch(part, len, rnd, commitUs, written)) return false;
+        done += written;
+        if (pushed) *pushed = done;
+    }
+
+    return true;
+}
+
+void Producer::compressBatch(size_t count, const LengthFn& lenOf, const RenderFn& render) {
+    /* Lengths are tagged when the topic has blobs, writeBatch() drops the result for a chunk without. */
+    int tag = _opt.blobThreshold ? 1 : 0;
+    size_t raw = 0;
+    for (size_t i = 0; i < count; ++i) {
+        size_t len = lenOf(i);
+        raw += BatchRecord::varintSize(uint64_t(len) << tag) + len;
+    }
+    if (raw > LZ4_MAX_INPUT_SIZE) return;
+
+    _packBuf.resize(raw);
+    char* dst = &_packBuf[0];
+    for (size_t i = 0; i < count; ++i) dst = BatchRecord::putVarint(dst, uint64_t(lenOf(i)) << tag);
+    for (size_t i = 0; i < count; ++i) {
+        render(i, dst);
+        dst += lenOf(i);
+    }
+
+    /* The count and commit time are only prepended by writeBatch(). */
+    size_t header = BatchRecord::varintSize(raw);
+    _zipped.resize(header + LZ4_compressBound(int(raw)));
+    BatchRecord::putVarint(&_zipped[0], raw);
+    int zipped = LZ4_compress_default(_packBuf.data(), &_zipped[header], int(raw), int(_zipped.size() - header));
+
+    /* A batch that does not shrink is stored as is by writeBatch(). */
+    if (zipped <= 0 || size_t(zipped) >= raw) {
+        _zipped.clear();
+    } else {
+        _zipped.resize(header + zipped);
+    }
+}
+
+/*
+ * Chunk bytes taken by a record of len, after LMDB's leaf layout (LEAFSIZE, OVPAGES in mdb.c):
+ * a node with an 8 byte header, the key and a 2 byte index slot, big values on overflow pages.
+ */
+static void addRecordCost(size_t pageSize, size_t len, size_t& leaf, size_t& overflow) {
+    const size_t pageHeader = 16, nodeHeader = 8;
+    size_t nodeMax = (((pageSize - pageHeader) / 2) & ~size_t(1)) - 2;
+    size_t node = nodeHeader + sizeof(uint64_t) + len;
+
+    if (node < nodeMax) {
+        leaf += ((node + 1) & ~size_t(1)) + 2;
+    } else {
+        leaf += nodeHeader + sizeof(uint64_t) + sizeof(size_t) + 2;
+        overflow += ((pageHeader - 1 + len) / pageSize + 1) * pageSize;
+    }
+}
+
+static size_t chunkCost(size_t pageSize, size_t leaf, size_t overflow) {
+    /* Page headers, a partly filled last page and about one branch page per 64 leaf pages. */
+    return leaf / (pageSize - 16) * pageSize * 65 / 64 + pageSize + overflow;
+}
+
+void Producer::dropOversized(size_t len) {
+    cout << "Producer push error: a " << len << " byte message does not fit a chunk of topic '" << _topic->getName() << "', dropped." << endl;
+    if (_stats) _stats->dropped.fetch_add(1, memory_order_relaxed);
+}
+
+bool Producer::isBlob(size_t len) const {
+    return _opt.blobThreshold && len >= _opt.blobThreshold;
+}
+
+size_t Producer::packedSize(size_t len, uint64_t blobOffset) const {
+    if (!_format.blobs) return BatchRecord::varintSize(len) + len;
+    if (!isBlob(len)) return BatchRecord::varintSize(uint64_t(len) << 1) + len;
+
+    size_t ref = BatchRecord::blobRefSize(blobOffset, len);
+    return BatchRecord::varintSize((uint64_t(ref) << 1) | 1) + ref;
+}
+
+bool Producer::appendBlob(const RenderFn& render, size_t i, size_t len, uint64_t& offset) {
+    if (_blobFile && _blobChunk != _current) {
+        fclose(_blobFile);
+        _blobFile = nullptr;
+    }
+    if (!_blobFile) {
+        char path[4096];
+        _topic->getBlobFilePath(path, _current);
+        _blobFile = fopen(path, "ab");
+        if (!_blobFile) {
+            cout << "Producer push error: cannot open blob file " << path << ": " << strerror(errno) << endl;
+            return false;
+        }
+        _blobChunk = _current;
+    }
+
+    /* Appended under the chunk write lock: the end of the file is where this blob starts. */
+#ifdef _WIN32
+    _fseeki64(_blobFile, 0, SEEK_END);
+    offset = _ftelli64(_blobFile);
+#else
+    fseeko(_blobFile, 0, SEEK_END);
+    offset = ftello(_blobFile);
+#endif
+
+    _blobBuf.resize(len);
+    render(i, &_blobBuf[0]);
+    if (fwrite(_blobBuf.data(), 1, len, _blobFile) != len || fflush(_blobFile) != 0) {
+        cout << "Producer push error: cannot write blob of topic '" << _topic->getName() << "': " << strerror(errno) << endl;
+        return false;
+    }
+#ifndef _WIN32
+    /* The record referring to it must not reach the disk first. */
+    if (_opt.durability != DURABILITY_NONE) fsync(fileno(_blobFile));
+#endif
+    return true;
+}
+
+size_t Producer::chunkRoom() {
+    MDB_envinfo info;
+    mdb_env_info(_env, &info);
+
+    /* Copies of the branch pages, free list records and the meta page of a commit. */
+    size_t used = (info.me_last_pgno + 1) * _pageSize, margin = 16 * _pageSize;
+    return info.me_mapsize > used + margin ? info.me_mapsize - used - margin : 0;
+}
+
+bool Producer::writeBatch(size_t count, const LengthFn& lenOf, const RenderFn& render, uint64_t* commitUs, size_t& written) {
+    written = 0;
+
+    /* Started by the first push: threads do not survive the fork of the nginx workers. */
+    if (_opt.durability == DURABILITY_PERIODIC && !_syncThread.joinable()) {
+        _syncRunning = true;
+        _syncThread = thread(bind(&Producer::syncWorker, this));
+    }
+
+    /*
+     * Only the part of the batch that fits the chunk is written, estimated from the chunk fill;
+     * the caller writes the rest to the next chunk. limit shrinks when LMDB disagrees.
+     */
+    size_t limit = count;
+    for (;;) {
+        if (!_env) {
+            cout << "Producer push error: topic '" << _topic->getName() << "' has no open chunk." << endl;
+            return false;
+        }
+
+        StatsTimer timer(_stats);
+        /* Chunk write lock first, then a meta snapshot: rotate() commits the next head file while it holds that lock. */
+        Txn txn(_topic->getEnv(), _env, false, true);
+        if (_topic->getProducerHeadFile(txn) != _current) {
+            /* A producer of another worker rotated. */
+            txn.abort();
+            followHead();
+            continue;
+        }
+
+        uint64_t head = chunkHead(txn.getTxn());
+        bool empty = head == (_firstSeq ? _firstSeq - 1 : 0);
+
+        /* Taken under the chunk write lock, so the commit times of a chunk only go up. */
+        uint64_t now = wallClockMs();
+        size_t stamp = _format.timed ? BatchRecord::varintSize(now) : 0;
+
+        /* Time-aligned chunks: the first write of a new interval starts the next chunk. */
+        if (_opt.rotateIntervalMs && !empty && now / _opt.rotateIntervalMs != _chunkCreatedMs / _opt.rotateIntervalMs) {
+            txn.abort();
+            rotate();
+            continue;
+        }
+        size_t room = chunkRoom();
+
+        size_t fit = 0, leaf = 0, overflow = 0, cost = 0;
+        bool zipped = false;
+        if (_format.batched) {
+            /* Compressed chunks: the compressed batch, or a raw size of 0 before the plain lengths and payloads. */
+            if (_format.codec != COMPRESSION_NONE && _format.blobs == (_opt.blobThreshold != 0) && !_zipped.empty() && limit == count) {
+                addRecordCost(_pageSize, BatchRecord::varintSize(count) + stamp + _zipped.size(), leaf, overflow);
+                cost = chunkCost(_pageSize, leaf, overflow);
+                zipped = cost <= room;
+                if (zipped) fit = count;
+            }
+
+            /* Blob references are estimated at their largest, the blobs themselves take no chunk room. */
+            size_t size = _format.codec != COMPRESSION_NONE ? BatchRecord::varintSize(0) : 0;
+            for (size_t i = 0; !zipped && i < limit; ++i) {
+                size += packedSize(lenOf(i), UINT64_MAX);
+
+                leaf = overflow = 0;
+                addRecordCost(_pageSize, BatchRecord::varintSize(i + 1) + stamp + size, leaf, overflow);
+                if (chunkCost(_pageSize, leaf, overflow) > room) break;
+                cost = chunkCost(_pageSize, leaf, overflow);
+                fit = i + 1;
+            }
+        } else {
+            for (size_t i = 0; i < limit; ++i) {
+                addRecordCost(_pageSize, lenOf(i), leaf, overflow);
+                if (chunkCost(_pageSize, leaf, overflow) > room) break;
+                cost = chunkCost(_pageSize, leaf, overflow);
+                fit = i + 1;
+            }
+        }
+
+        if (fit == 0) {
+            txn.abort();
+            if (empty) {
+                /* Not even a fresh chunk holds it, no rotation ever will. */
+                dropOversized(lenOf(0));
+                written = 1;
+                return true;
+            }
+
+            rotate();
+            limit = count;
+            continue;
+        }
+
+        uint64_t bytes = 0, stored = 0, blobEnd = 0, first = head + 1;
+        int rc = 0;
+        if (_format.batched) {
+            /* Blobs go to the blob file first, a failed commit leaves unreferenced bytes behind only. */
+            _blobOffsets.assign(fit, UINT64_MAX);
+            uint64_t blobBytes = 0;
+            for (size_t i = 0; _format.blobs && !zipped && i < fit; ++i) {
+                size_t len = lenOf(i);
+                if (!isBlob(len)) continue;
+                if (!appendBlob(render, i, len, _blobOffsets[i])) return false;
+                blobBytes += len;
+                blobEnd = _blobOffsets[i] + len;
+            }
+            if (blobBytes && _stats) _stats->blobBytes.fetch_add(blobBytes, memory_order_relaxed);
+
+            /* One record for the whole batch: the count and commit time, the lengths, then the payloads. */
+            size_t header = BatchRecord::varintSize(fit) + stamp;
+            size_t size = header + (_format.codec != COMPRESSION_NONE ? BatchRecord::varintSize(0) : 0);
+            for (size_t i = 0; i < fit; ++i) {
+                size += packedSize(lenOf(i), _blobOffsets[i]);
+                bytes += lenOf(i);
+            }
+            if (zipped) size = header + _zipped.size();
+            stored = size;
+
+            MDB_val key{ sizeof(first), &first },
+                    val{ size, nullptr };
+            rc = mdb_put(txn.getTxn(), _db, &key, &val, MDB_APPEND | MDB_RESERVE);
+            char* dst = rc == 0 ? BatchRecord::putVarint((char*)val.mv_data, fit) : nullptr;
+            if (dst && _format.timed) dst = BatchRecord::putVarint(dst, now);
+            if (rc == 0 && zipped) {
+                memcpy(dst, _zipped.data(), _zipped.size());
+            } else if (rc == 0) {
+                if (_format.codec != COMPRESSION_NONE) dst = BatchRecord::putVarint(dst, 0);
+                for (size_t i = 0; i < fit; ++i) {
+                    size_t len = lenOf(i);
+                    if (!_format.blobs) {
+                        dst = BatchRecord::putVarint(dst, len);
+                    } else if (_blobOffsets[i] == UINT64_MAX) {
+                        dst = BatchRecord::putVarint(dst, uint64_t(len) << 1);
+                    } else {
+                        dst = BatchRecord::putVarint(dst, (uint64_t(BatchRecord::blobRefSize(_blobOffsets[i], len)) << 1) | 1);
+                    }
+                }
+                for (size_t i = 0; i < fit; ++i) {
+                    if (_blobOffsets[i] != UINT64_MAX) {
+                        dst = BatchRecord::putBlobRef(dst, _blobOffsets[i], lenOf(i));
+                    } else {
+                        render(i, dst);
+                        dst += lenOf(i);
+                    }
+                }
+            }
+            head += fit;
+        } else {
+            for (size_t i = 0; rc == 0 && i < fit; ++i) {
+                MDB_val key{ sizeof(head), &++head },
+                        val{ lenOf(i), nullptr };
+                bytes += val.mv_size;
+
+                /* MDB_RESERVE hands back the value slot inside the dirty page, the record is rendered right there. */
+                rc = mdb_put(txn.getTxn(), _db, &key, &val, MDB_APPEND | MDB_RESERVE);
+                if (rc == 0) render(i, (char*)val.mv_data);
+            }
+            stored = bytes;
+        }
+
+        uint64_t commitTook = 0;
+        if (rc == 0) {
+            if (_stats) timer.record(_stats->txnBuild);
+
+            chrono::steady_clock::time_point commitStart = chrono::steady_clock::now();
+            rc = txn.commit();
+            commitTook = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - commitStart).count();
+            if (commitUs) *commitUs += commitTook;
+        } else {
+            txn.abort();
+        }
+
+        if (rc == MDB_MAP_FULL) {
+            /* The estimate was short: retry with half of it, or start the next chunk. */
+            if (_stats) _stats->mapFullRetries.fetch_add(1, memory_order_relaxed);
+            if (fit > 1) {
+                limit = fit / 2;
+            } else if (empty) {
+                dropOversized(lenOf(0));
+                written = 1;
+                return true;
+            } else {
+                rotate();
+                limit = count;
             }
+            continue;
+        } else if (rc != 0) {
+            cout << "Producer push error: " << mdb_strerror(rc) << endl;
+            return false;
         }
 
-        if (!isFull) {
-            _topic->setProducerHead(txn, head);
-            int rc = txn.commit();
-            if (rc == MDB_MAP_FULL) {
-                isFull = true;
+        _head = head;
+        written = fit;
+
+        /* Meta learns the chunk's time range and an index entry with the next checkpoint. */
+        if (!_chunkMinMs) _chunkMinMs = now;
+        _chunkMaxMs = now;
+        if (!_indexMs) {
+            _indexMs = now;
+            _indexSeq = first;
+        }
+        if (!_prepThread.joinable() && !_nextEnv) {
+            MDB_envinfo info;
+            mdb_env_info(_env, &info);
+            if ((info.me_last_pgno + 1) * _pageSize >= info.me_mapsize / 5 * 4) {
+                _nextFile = _current + 1;
+                _prepThread = thread(bind(&Producer::prepareNext, this));
             }
         }
+
+        if (_stats) {
+            if (_opt.durability >= DURABILITY_MAPASYNC) _stats->sync.record(commitTook);
+            timer.record(_stats->commit);
+            _stats->flushes.fetch_add(1, memory_order_relaxed);
+            _stats->pushes.fetch_add(fit, memory_order_relaxed);
+            _stats->bytes.fetch_add(bytes, memory_order_relaxed);
+            _stats->storedBytes.fetch_add(stored, memory_order_relaxed);
+            if (fit < count) _stats->splitBatches.fetch_add(1, memory_order_relaxed);
+        }
+
+        /*
+         * Rotate now rather than in the next batch: this one was split, or one like it would not fit (at most 1/32 of the chunk is left).
+         * A blob file is capped at the chunk size as well, so chunksToKeep still bounds the disk usage.
+         */
+        if (fit < count || chunkRoom() < min(cost, _opt.chunkSize / 32) || blobEnd >= _opt.chunkSize) rotate();
+        break;
     }
 
-    if (isFull) {
-        rotate();
-        return push(batch);
+    if (chrono::steady_clock::now() - _checkpointAt >= chrono::seconds(1)) {
+        checkpoint();
     }
 
     return true;
 }
 
 void Producer::setCacheSize(size_t sz) {
-    std::lock_guard<std::mutex> guard(_cacheMtx);
     _cacheMax = sz;
 
-    if (_cacheCurrent->size() > sz) {
-        flushImpl();
+    if (_cacheSize.load() >= int64_t(sz)) {
+        flush();
     }
 }
 
 void Producer::push2Cache(BatchType& batch) {
-    std::lock_guard<std::mutex> guard(_cacheMtx);
-
     for (auto& item : batch) {
-        _cacheCurrent->push_back(std::move(item));
+        push2Cache(std::move(item));
     }
 
     batch.clear();
+}
 
-    if (_cacheCurrent->size() >= _cacheMax) {
-        flushImpl();
-    }
+void Producer::setOverflow(OverflowPolicy policy, size_t highWater, chrono::milliseconds maxWait) {
+    _overflow = policy;
+    _highWater = highWater;
+    _overflowWait = maxWait;
 }
 
 void Producer::push2Cache(ItemType&& item) {
-    std::lock_guard<std::mutex> guard(_cacheMtx);
-    _cacheCurrent->push_back(std::move(item));
-    if (_cacheCurrent->size() >= _cacheMax) {
-        flushImpl();
+    StatsTimer timer(_stats);
+    size_t len = item.len();
+    bool waiting = false;
+    chrono::steady_clock::time_point deadline;
+
+    /* Larger than the high-water mark or the budget: no flush makes room for it, it goes straight to spill or drop. */
+    bool fits = (!_highWater || len <= _highWater) && (!_memoryBudget || len <= _memoryBudget);
+
+    for (;;) {
+        /* Bytes are accounted before the item is visible, so the flush thread never subtracts them first. */
+        if (fits && !overBudget(len)) {
+            account(len, true);
+            if (_cache.push(std::move(item))) break;
+            account(len, false);
+        }
+
+        /* Over the budget or the queue is full: the flush thread is behind. */
+        if (fits && _overflow == OVERFLOW_DROP_OLDEST && dropOldest()) {
+            continue;
+        }
+
+        if (fits && _overflow == OVERFLOW_BLOCK) {
+            if (!waiting) {
+                waiting = true;
+                deadline = chrono::steady_clock::now() + _overflowWait;
+                if (_stats) _stats->blocked.fetch_add(1, memory_order_relaxed);
+            }
+
+            /* Bounded even while the flush thread is stuck (e.g. on a full disk), this is the event loop's thread. */
+            if (chrono::steady_clock::now() < deadline) {
+                if (_bgEnabled) {
+                    requestFlush();
+                    this_thread::yield();
+                } else {
+                    drainCache();
+                }
+                continue;
+            }
+        }
+
+        if (_overflow == OVERFLOW_SPILL && spill(item)) {
+            requestFlush();
+            return;
+        }
+
+        if (_stats) _stats->dropped.fetch_add(1, memory_order_relaxed);
+        return;
+    }
+
+    if (_stats) {
+        timer.record(_stats->cacheWait);
+        _stats->cacheDepth.fetch_add(1, memory_order_relaxed);
+    }
+
+    if (_cacheSize.fetch_add(1, memory_order_relaxed) + 1 >= int64_t(_cacheMax.load()) || (_flushCtl && _cacheBytes.load(memory_order_relaxed) >= _flushCtl->batchBytes())) {
+        flush();
+    }
+}
+
+bool Producer::overBudget(size_t len) const {
+    return (_highWater && _cacheBytes.load(memory_order_relaxed) + len > _highWater)
+        || (_memoryBudget && _memoryUsed.load(memory_order_relaxed) + len > _memoryBudget);
+}
+
+void Producer::account(size_t len, bool add) {
+    if (add) {
+        _cacheBytes.fetch_add(len, memory_order_relaxed);
+        _memoryUsed.fetch_add(len, memory_order_relaxed);
+    } else {
+        _cacheBytes.fetch_sub(len, memory_order_relaxed);
+        _memoryUsed.fetch_sub(len, memory_order_relaxed);
     }
 }
 
+bool Producer::dropOldest() {
+    ItemType item;
+    {
+        /* Pushers pop too under this policy, _popMtx keeps the queue single consumer. */
+        std::lock_guard<std::mutex> guard(_popMtx);
+        if (!_cache.pop(item)) return false;
+    }
+
+    account(item.len(), false);
+    _cacheSize.fetch_sub(1, memory_order_relaxed);
+    if (_stats) {
+        _stats->cacheDepth.fetch_sub(1, memory_order_relaxed);
+        _stats->dropped.fetch_add(1, memory_order_relaxed);
+    }
+    return true;
+}
+
+/* A length with the high bit set frames a span replayFile() wrote already; with records below 1GB, a replayed batch always fits one. */
+static const uint32_t spillReplayed = 0x80000000u;
+static const size_t spillMaxRecord = 1024 * 1024 * 1024;
+
+bool Producer::spill(const ItemType& item) {
+    if (item.len() >= spillMaxRecord) return false;
+
+    std::lock_guard<std::mutex> guard(_spillMtx);
+    if (!_spillFile) {
+        char pid[32];
+#ifdef _WIN32
+        sprintf(pid, "%lu", (unsigned long)GetCurrentProcessId());
+#else
+        sprintf(pid, "%ld", (long)getpid());
+#endif
+        _spillPath = _topic->getEnv()->getRoot() + "/" + _topic->getName() + ".spill." + pid;
+        _spillFile = fopen(_spillPath.c_str(), "ab");
+        if (!_spillFile) {
+            cout << "Producer spill error: cannot open " << _spillPath << ": " << strerror(errno) << endl;
+            return false;
+        }
+#ifndef _WIN32
+        flock(fileno(_spillFile), LOCK_EX | LOCK_NB);
+#endif
+    }
+
+    uint32_t len = uint32_t(item.len());
+    /* Flushed per record, a crashed worker leaves whole records for replayOrphanedSpills(). */
+    if (fwrite(&len, sizeof(len), 1, _spillFile) != 1 || fwrite(item.data(), 1, len, _spillFile) != len || fflush(_spillFile) != 0) {
+        cout << "Producer spill error: cannot write " << _spillPath << ": " << strerror(errno) << endl;
+        return false;
+    }
+
+    _spillCount.fetch_add(1, memory_order_relaxed);
+    if (_stats) _stats->spilled.fetch_add(1, memory_order_relaxed);
+    return true;
+}
+
+void Producer::replaySpill() {
+    if (_spillCount.load(memory_order_relaxed) == 0) return;
+
+    /* A replay file left by a failed replay goes first, it holds the older records. */
+    string replayPath = _spillPath + ".replay";
+    if (_replayFile) {
+        if (!replayFile(replayPath)) return;
+        fclose(_replayFile);
+        _replayFile = nullptr;
+    }
+
+    {
+        /* Pushers keep spilling into a fresh file while this one is written to LMDB. */
+        std::lock_guard<std::mutex> guard(_spillMtx);
+        fflush(_spillFile);
+        if (rename(_spillPath.c_str(), replayPath.c_str()) != 0) {
+            cout << "Producer spill error: cannot rename " << _spillPath << ": " << strerror(errno) << endl;
+            return;
+        }
+
+        /* Still open, so the replay file keeps the lock of the spill file. */
+        _replayFile = _spillFile;
+        _spillFile = nullptr;
+        _spillCount = 0;
+    }
+
+    if (replayFile(replayPath)) {
+        fclose(_replayFile);
+        _replayFile = nullptr;
+    }
+}
+
+void Producer::replayOrphanedSpills() {
+#ifndef _WIN32
+    /* Spill files of crashed, restarted or reloaded workers: nobody holds their lock any more. */
+    string root = _topic->getEnv()->getRoot();
+    string prefix = _topic->getName() + ".spill.";
+
+    DIR* dir = opendir(root.c_str());
+    if (!dir) return;
+
+    vector<string> paths;
+    while (struct dirent* entry = readdir(dir)) {
+        string path = root + "/" + entry->d_name;
+        if (strncmp(entry->d_name, prefix.c_str(), prefix.size()) != 0 || path == _spillPath || path == _spillPath + ".replay") continue;
+        paths.push_back(path);
+    }
+    closedir(dir);
+
+    /* A replay file holds older records than the spill file of the same process. */
+    sort(paths.begin(), paths.end(), [](const string& a, const string& b) {
+        bool aReplay = a.size() > 7 && a.compare(a.size() - 7, 7, ".replay") == 0;
+        bool bReplay = b.size() > 7 && b.compare(b.size() - 7, 7, ".replay") == 0;
+        return aReplay != bReplay ? aReplay : a < b;
+    });
+
+    for (auto& path : paths) {
+        FILE* f = fopen(path.c_str(), "rb");
+        if (!f) continue;
+
+        /* Locked: its owner is alive. Claimed after the owner replayed and removed it: nothing left. */
+        struct stat claimed, current;
+        bool orphan = flock(fileno(f), LOCK_EX | LOCK_NB) == 0
+            && fstat(fileno(f), &claimed) == 0 && stat(path.c_str(), &current) == 0 && claimed.st_ino == current.st_ino;
+
+        uint64_t replayed = 0;
+        if (orphan) {
+            cout << "Producer spill: replaying " << path << " left by an exited process." << endl;
+            replayFile(path, &replayed);
+            if (_stats) _stats->spillRecovered.fetch_add(replayed, memory_order_relaxed);
+        }
+        fclose(f);
+    }
+#endif
+}
+
+bool Producer::replayFile(const string& path, uint64_t* replayed) {
+
+    FILE* f = fopen(path.c_str(), "r+b");
+    if (!f) {
+        cout << "Producer spill error: cannot open " << path << ": " << strerror(errno) << endl;
+        return false;
+    }
+
+    BatchType batch;
+    vector<long> starts; // File offset of every record of batch, then of the record after it.
+    size_t batchBytes = 0;
+
+    /* The written records become one skipped span, so a retry after a failure further on does not write them twice. */
+    auto pushBatch = [&]() {
+        size_t pushed = 0;
+        bool ok = pushReserved(batch.size(),
+            [&batch](size_t i) { return batch[i].len(); },
+            [&batch](size_t i, char* dst) { memcpy(dst, batch[i].data(), batch[i].len()); },
+            &pushed);
+        if (replayed) *replayed += pushed;
+
+        if (pushed) {
+            long end = ftell(f);
+            uint32_t span = uint32_t(starts[pushed] - starts[0] - sizeof(span)) | spillReplayed;
+            if (fseek(f, starts[0], SEEK_SET) != 0 || fwrite(&span, sizeof(span), 1, f) != 1 || fflush(f) != 0 || fseek(f, end, SEEK_SET) != 0) {
+                cout << "Producer spill error: cannot mark replayed records in " << path << ": " << strerror(errno) << endl;
+            }
+        }
+
+        batch.clear();
+        starts.clear();
+        batchBytes = 0;
+        return ok;
+    };
+
+    bool ok = true;
+    uint32_t len;
+    long at = ftell(f);
+    while (ok && fread(&len, sizeof(len), 1, f) == 1) {
+        if (len & spillReplayed) {
+            fseek(f, len & ~spillReplayed, SEEK_CUR);
+            at = ftell(f);
+            continue;
+        }
+
+        ItemType item = ItemType::create(len);
+        if (fread(item.data(), 1, len, f) != len) {
+            cout << "Producer spill error: " << path << " is truncated." << endl;
+            break;
+        }
+
+        starts.push_back(at);
+        at = ftell(f);
+        batchBytes += len;
+        batch.push_back(std::move(item));
+        if (batchBytes >= 4 * 1024 * 1024) {
+            starts.push_back(at);
+            ok = pushBatch();
+        }
+    }
+
+    if (ok && !batch.empty()) {
+        starts.push_back(at);
+        ok = pushBatch();
+    }
+    fclose(f);
+
+    if (ok) {
+        remove(path.c_str());
+    } else {
+        cout << "Producer spill error: records not written yet are kept in " << path << "." << endl;
+    }
+    return ok;
+}
+
 void Producer::flush() {
-    std::lock_guard<std::mutex> guard(_cacheMtx);
-    flushImpl();
+    if (_bgEnabled) {
+        requestFlush();
+    } else {
+        drainCache();
+    }
+}
+
+void Producer::requestFlush() {
+    /* Edge triggered: one wake-up per batch, the flush thread clears the flag when it drains. */
+    if (!_flushRequested.exchange(true)) {
+        unique_lock<mutex> lck(_flushMtx);
+        _bgCv.notify_one();
+    }
 }
 
 void Producer::flushWorker() {
     while (_bgRunning) {
         {
             unique_lock<mutex> lck(_flushMtx);
-            _bgCv.wait_for(lck, _flushInterval);
+            _bgCv.wait_for(lck, _flushCtl ? _flushCtl->interval() : _flushInterval, [this]() { return _flushRequested.load() || !_bgRunning; });
         }
 
-        BatchType *flush = nullptr;
+        drainCache();
 
-        {
-            lock_guard<mutex> guard(_cacheMtx);
-            if (_cacheCurrent->size() > 0) {
-                flush = _cacheCurrent;
-                _cacheCurrent = _cacheCurrent == &_cache0 ? &_cache1 : &_cache0;
-            }
+        /* Retention also has to catch up on a topic nobody writes to. */
+        if (_opt.maxAgeMs || _opt.minFreeBytes) {
+            std::lock_guard<std::mutex> guard(_writeMtx);
+            if (chrono::steady_clock::now() - _checkpointAt >= chrono::seconds(1)) checkpoint();
         }
+    }
+}
+
+void Producer::drainCache() {
+    std::lock_guard<std::mutex> guard(_drainMtx);
+    _flushRequested = false;
 
-        if (flush) {
-            push(*flush);
-            flush->clear();
+    {
+        std::lock_guard<std::mutex> guard(_popMtx);
+        ItemType item;
+        while (_cache.pop(item)) {
+            _flushBatch.push_back(std::move(item));
         }
     }
-}
 
-void Producer::flushImpl() {
-    if (_cacheCurrent->size() > 0) {
-        if (_bgEnabled) {
-            unique_lock<mutex> lck(_flushMtx);
-            _bgCv.notify_one();
-        } else {
-            push(*_cacheCurrent);
-            _cacheCurrent->clear();
+    if (!_flushBatch.empty()) {
+        size_t bytes = 0;
+        for (auto& item : _flushBatch) bytes += item.len();
+        _cacheSize.fetch_sub(int64_t(_flushBatch.size()), memory_order_relaxed);
+
+        uint64_t commitUs = 0;
+        {
+            std::lock_guard<std::mutex> guard(_writeMtx);
+            const BatchType& batch = _flushBatch;
+            pushImpl(batch.size(),
+                [&batch](size_t i) { return batch[i].len(); },
+                [&batch](size_t i, char* dst) { memcpy(dst, batch[i].data(), batch[i].len()); },
+                &commitUs);
         }
+        if (_flushCtl) _flushCtl->onFlush(bytes, commitUs);
+        if (_stats) _stats->cacheDepth.fetch_sub(int64_t(_flushBatch.size()), memory_order_relaxed);
+        _flushBatch.clear();
+
+        /* The batch counts against the budget until it is committed, a stalled disk must not let the cache grow. */
+        account(bytes, false);
+    }
+
+    /* Once per producer, after partition() opened its chunk series. */
+    if (!_orphansChecked && _env) {
+        _orphansChecked = true;
+        replayOrphanedSpills();
     }
+    replaySpill();
 }
 
 void Producer::closeCurrent() {
-    mdb_dbi_close(_env, _db);
-    mdb_env_close(_env);
+    std::lock_guard<std::mutex> guard(_envMtx);
+    if (_env) {
+        /* A finished chunk is synced completely, whatever the mode left pending. */
+        if (_opt.durability != DURABILITY_NONE) mdb_env_sync(_env, 1);
+        closeChunkEnv(_env);
+        _env = nullptr;
+    }
+
+    if (_blobFile) {
+#ifndef _WIN32
+        if (_opt.durability != DURABILITY_NONE) fsync(fileno(_blobFile));
+#endif
+        fclose(_blobFile);
+        _blobFile = nullptr;
+    }
 }
 
-void Producer::openHead(Txn* txn, bool rotating) {
+void Producer::syncWorker() {
+    unique_lock<mutex> lck(_syncMtx);
+    while (_syncRunning) {
+        _syncCv.wait_for(lck, chrono::milliseconds(_opt.syncIntervalMs));
+
+        std::lock_guard<std::mutex> guard(_envMtx);
+        if (_env) {
+            StatsTimer timer(_stats);
+            int rc = mdb_env_sync(_env, 1);
+            if (rc != 0) {
+                cout << "Producer sync error: " << mdb_strerror(rc) << endl;
+            } else if (_stats) {
+                timer.record(_stats->sync);
+            }
+        }
+    }
+}
+
+void Producer::openHead() {
+    /*
+     * Write txns only: this runs in the nginx master, a read txn would leave a thread local
+     * reader slot behind that the forked workers inherit.
+     */
+    {
+        Txn txn(_topic->getEnv(), NULL);
+        selectHead(&txn);
+        txn.commit();
+    }
+
+    openCurrent();
+
+    /* Reconcile: the chunk may hold records committed after the last checkpoint. */
+    MDB_txn* txn;
+    if (_env && mdb_txn_begin(_env, NULL, 0, &txn) == 0) {
+        _head = chunkHead(txn);
+        mdb_txn_abort(txn);
+        checkpoint();
+    }
+}
+
+void Producer::followHead() {
+    closeCurrent();
+    {
+        Txn txn(_topic->getEnv(), NULL, true);
+        selectHead(&txn);
+    }
+    if (!adoptPrepared()) openCurrent();
+}
+
+void Producer::selectHead(Txn* txn, bool rotating, uint64_t head) {
     uint32_t headFile = _topic->getProducerHeadFile(*txn);
     if (rotating && _current == headFile) {
-        _topic->setProducerHeadFile(*txn, ++headFile, _topic->getProducerHead(*txn) + 1);
+        _topic->setProducerHeadFile(*txn, ++headFile, head + 1);
     }
 
+    if (_current != headFile) _chunkMinMs = _chunkMaxMs = 0;
     _current = headFile;
 
+    /* Chunks registered by older trees have no creation time, their interval starts now. */
+    ChunkMeta meta;
+    bool known = _topic->getChunkMeta(*txn, headFile, meta);
+    _firstSeq = known ? meta.firstSeq : 0;
+    _chunkCreatedMs = known && meta.createdMs ? meta.createdMs : wallClockMs();
+}
+
+void Producer::openCurrent() {
+    MDB_dbi db;
+    ChunkFormat format;
+    MDB_env* env = openChunk(_current, db, format);
+    {
+        std::lock_guard<std::mutex> guard(_envMtx);
+        _env = env;
+        _db = db;
+        _format = format;
+    }
+
+    if (_env) {
+        MDB_stat st;
+        mdb_env_stat(_env, &st);
+        _pageSize = st.ms_psize;
+    }
+}
+
+void Producer::closeChunkEnv(MDB_env* env) {
+    const char* path = nullptr;
+    string shared = mdb_env_get_path(env, &path) == 0 && path ? path : "";
+    ChunkEnvs::release(shared.c_str());
+}
+
+MDB_env* Producer::openChunk(uint32_t file, MDB_dbi& db, ChunkFormat& format) {
+    format = ChunkFormat{ false, COMPRESSION_NONE, false, false };
+
     char path[4096];
-    _topic->getChunkFilePath(path, headFile);
+    _topic->getChunkFilePath(path, file);
 
 #ifdef _WIN32
     Sleep(500); // Fix error on windows when multi process rotate at same time. ("The requested operation cannot be performed on a file with a user-mapped section open.")
 #endif
-    mdb_env_create(&_env);
-    mdb_env_set_mapsize(_env, _opt.chunkSize);
-    int rc = mdb_env_open(_env, path, MDB_NOSYNC | MDB_NOSUBDIR, 0664);
-
-    int cleared = 0;
-    mdb_reader_check(_env, &cleared);
-
-    if (rc != 0) {
-        mdb_env_close(_env);
-        _env = nullptr;
-        printf("Producer open error.\n%s\n", mdb_strerror(rc));
-        return;
+    unsigned int flags = 0;
+    switch (_opt.durability) {
+    case DURABILITY_NONE:
+    case DURABILITY_PERIODIC:
+        flags |= MDB_NOSYNC;
+        break;
+    case DURABILITY_MAPASYNC:
+        flags |= MDB_WRITEMAP | MDB_MAPASYNC;
+        break;
+    case DURABILITY_NOMETASYNC:
+        flags |= MDB_NOMETASYNC;
+        break;
+    default:
+        break;
     }
 
+    /* Also false for a chunk dropped from meta already, by another worker's retention. */
+    MDB_env* env;
+    if (!ChunkEnvs::acquireWritable(path, flags, _opt.chunkSize, env, db)) return nullptr;
+
     MDB_txn *otxn;
-    mdb_txn_begin(_env, NULL, 0, &otxn);
-    mdb_dbi_open(otxn, NULL, MDB_CREATE, &_db);
-    mdb_set_compare(otxn, _db, mdbIntCmp<uint64_t>);
+    mdb_txn_begin(env, NULL, 0, &otxn);
+
+    /* The first producer to open a chunk decides its format, chunks of an older format stay readable. */
+    MDB_stat st;
+    if (_opt.batched && mdb_stat(otxn, db, &st) == 0 && st.ms_entries == 0) {
+        ChunkFormat mine{ true, _opt.compression, _opt.blobThreshold != 0, true };
+        BatchRecord::mark(otxn, db, mine);
+    }
+    format = BatchRecord::format(otxn, db);
     mdb_txn_commit(otxn);
+    return env;
+}
+
+void Producer::prepareNext() {
+    MDB_env* env = openChunk(_nextFile, _nextDb, _nextFormat);
+
+#ifdef __linux__
+    /* Reserve the blocks up front, KEEP_SIZE leaves the file size (and so LMDB) alone. */
+    int fd;
+    if (env && mdb_env_get_fd(env, &fd) == 0 && fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, _opt.chunkSize) != 0) {
+        cout << "LMDB_QUEUE WARNING: Cannot reserve chunk " << _nextFile << " of topic '" << _topic->getName() << "': " << strerror(errno) << endl;
+    }
+#endif
+
+    _nextEnv = env;
+}
+
+bool Producer::adoptPrepared() {
+    if (_prepThread.joinable()) _prepThread.join();
+
+    MDB_env* env = _nextEnv;
+    _nextEnv = nullptr;
+    if (!env) return false;
+
+    /* Another worker may have rotated to a different file meanwhile. */
+    if (_nextFile != _current) {
+        closeChunkEnv(env);
+        return false;
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(_envMtx);
+        _env = env;
+        _db = _nextDb;
+        _format = _nextFormat;
+    }
+
+    MDB_stat st;
+    mdb_env_stat(_env, &st);
+    _pageSize = st.ms_psize;
+    return true;
+}
+
+uint64_t Producer::chunkHead(MDB_txn* txn) {
+    uint64_t last = BatchRecord::lastSeq(txn, _db);
+    if (last) return last;
+
+    /* Empty chunk: the first one starts at 1 but is registered at 0. */
+    return _firstSeq ? _firstSeq - 1 : 0;
+}
+
+void Producer::checkpoint() {
+    _checkpointAt = chrono::steady_clock::now();
+    bool retention = _opt.maxAgeMs || _opt.maxBytes || _opt.minFreeBytes;
+    if (_head <= _checkpointed && !retention) return;
+
+    vector<uint32_t> removed;
+    {
+        Txn txn(_topic->getEnv(), NULL);
+        if (_head > _checkpointed) {
+            _topic->checkpointProducerHead(txn, _head);
+            recordTimes(txn);
+        }
+        if (retention) trimChunks(txn, false, removed);
+        if (txn.commit() == 0) {
+            _checkpointed = max(_checkpointed, _head);
+        } else {
+            removed.clear();
+        }
+    }
+
+    reapChunks(removed);
+}
+
+void Producer::trimChunks(Txn& txn, bool rotating, vector<uint32_t>& removed) {
+    vector<pair<uint32_t, ChunkMeta>> chunks = _topic->getChunks(txn);
+    uint64_t now = wallClockMs();
+
+    /* Closed chunks have their size in meta, the head chunk (and chunks of older trees) are measured. */
+    vector<uint64_t> sizes;
+    uint64_t total = 0;
+    if (_opt.maxBytes || _opt.minFreeBytes) {
+        for (auto& chunk : chunks) {
+            sizes.push_back(chunk.second.bytes ? chunk.second.bytes : _topic->chunkDiskBytes(chunk.first));
+            total += sizes.back();
+        }
+    }
+
+    /* Chunks already handed to the Reaper count as freed. */
+    uint64_t lacking = 0;
+    if (_opt.minFreeBytes) {
+        uint64_t free = _topic->getEnv()->freeDiskBytes() + Reaper::instance().pendingBytes();
+        if (free < _opt.minFreeBytes) lacking = _opt.minFreeBytes - free;
+    }
+
+    size_t count = chunks.size() + (rotating ? 1 : 0);
+    for (size_t i = 0; i + 1 < chunks.size(); ++i) {
+        const ChunkMeta& meta = chunks[i].second;
+        /* Time of its newest message, or about that: the rotation away from it. */
+        uint64_t endMs = meta.maxMs ? meta.maxMs : meta.closedMs ? meta.closedMs : chunks[i + 1].second.createdMs;
+        uint64_t bytes = sizes.empty() ? 0 : sizes[i];
+
+        bool expired = count > _opt.chunksToKeep
+            || (_opt.maxAgeMs && endMs && now > endMs + _opt.maxAgeMs)
+            || (_opt.maxBytes && total > _opt.maxBytes);
+        if (!expired && !lacking) break;
+
+        uint32_t file;
+        if (!_topic->removeOldestChunk(txn, file)) break;
+        removed.push_back(file);
+
+        if (!expired) {
+            cout << "LMDB_QUEUE WARNING: Low disk space, trimming chunk " << file << " of topic '" << _topic->getName() << "'." << endl;
+            if (_stats) _stats->lowDiskTrims.fetch_add(1, memory_order_relaxed);
+        }
+        --count;
+        total -= bytes;
+        lacking = lacking > bytes ? lacking - bytes : 0;
+    }
+}
+
+void Producer::recordTimes(Txn& txn) {
+    if (_chunkMaxMs) _topic->setChunkTimes(txn, _current, _chunkMinMs, _chunkMaxMs);
+    if (_indexMs) _topic->addTimeIndex(txn, _indexMs, _indexSeq);
+    _indexMs = 0;
+}
+
+void Producer::reapChunks(const vector<uint32_t>& removed) {
+    /* Unlinking a multi-GB file can stall, never with the meta or a chunk write lock held. */
+    for (uint32_t file : removed) {
+        char path[4096];
+        _topic->getChunkFilePath(path, file);
+        Reaper::instance().add(path, _stats);
+    }
 }
 
 void Producer::rotate() {
-    Txn txn(_topic->getEnv(), NULL);
+    StatsTimer timer(_stats);
 
-    closeCurrent();
-    for (size_t chunks = _topic->countChunks(txn); chunks >= _opt.chunksToKeep; --chunks) {
-        _topic->removeOldestChunk(txn);
+    /*
+     * The old chunk's write lock is held until its successor is in meta: producers of other
+     * workers either appended before the head was taken, or see the new head file in pushImpl().
+     */
+    MDB_txn* lock = nullptr;
+    if (_env && mdb_txn_begin(_env, NULL, 0, &lock) == 0) {
+        _head = max(_head, chunkHead(lock));
     }
 
-    openHead(&txn, true);
-    txn.commit();
+    vector<uint32_t> removed;
+    {
+        Txn txn(_topic->getEnv(), NULL);
+        bool closing = _topic->getProducerHeadFile(txn) == _current;
+        recordTimes(txn);
+        if (closing) _topic->setChunkClosed(txn, _current, _topic->chunkDiskBytes(_current));
+        trimChunks(txn, closing, removed);
+
+        selectHead(&txn, true, _head);
+        _topic->checkpointProducerHead(txn, _head);
+        if (txn.commit() == 0) {
+            _checkpointed = _head;
+            /* A lost registration would hide the new chunk, so it is as durable as the data. */
+            if (_opt.durability != DURABILITY_NONE) mdb_env_sync(_topic->getEnv()->getMdbEnv(), 1);
+        } else {
+            removed.clear();
+        }
+        _checkpointAt = chrono::steady_clock::now();
+    }
+
+    reapChunks(removed);
+
+    if (lock) mdb_txn_abort(lock);
+    closeCurrent();
+    bool prepared = adoptPrepared();
+    if (!prepared) openCurrent();
+
+    if (_stats) {
+        timer.record(_stats->rotate);
+        _stats->rotations.fetch_add(1, memory_order_relaxed);
+        if (prepared) _stats->preparedRotations.fetch_add(1, memory_order_relaxed);
+    }
 }
@@ -1,14 +1,22 @@
 #pragma once
 
 #include <thread>
+#include <atomic>
 #include <condition_variable>
 #include <chrono>
+#include <functional>
 #include <vector>
 #include <tuple>
 #include <string>
+#include <stdio.h>
+#include <memory>
 
 #include <lmdb/lmdb.h>
 #include "env.h"
+#include "stats.h"
+#include "mpsc.h"
+#include "flush.h"
+#include "batch.h"
 
 class Topic;
 
@@ -17,17 +25,25 @@ public:
     class ItemType {
     public:
         static ItemType create(size_t len);
+        /* Buffer from a process-wide pool of large blocks, handed back once the flush thread has written the item. */
+        static ItemType pooled(size_t len);
 
     public:
-        ItemType(char* mem, size_t len) : _mem(mem), _len(len), _shouldDelete(false) {
+        ItemType() : _mem(nullptr), _len(0), _cap(0), _shouldDelete(false) {
         }
 
-        ItemType(ItemType&& r) : _mem(r._mem), _len(r._len), _shouldDelete(r._shouldDelete) {
+        ItemType(char* mem, size_t len) : _mem(mem), _len(len), _cap(0), _shouldDelete(false) {
+        }
+
+        ItemType(ItemType&& r) : _mem(r._mem), _len(r._len), _cap(r._cap), _shouldDelete(r._shouldDelete) {
             r._mem = nullptr;
             r._len = 0;
+            r._cap = 0;
             r._shouldDelete = false;
         }
 
+        ItemType& operator=(ItemType&& r);
+
         ~ItemType();
 
     public:
@@ -38,15 +54,29 @@ public:
     private:
         ItemType(const ItemType&);
         ItemType& operator=(const ItemType&);
+        void release();
 
     private:
         char* _mem;
         size_t _len;
+        size_t _cap; // Size class of a pooled buffer, 0: not pooled.
         bool _shouldDelete;
     };
 
     typedef std::vector<ItemType> BatchType;
 
+    /* Reserved writes: lenOf(i) states the size of record i, render(i, dst) fills exactly that many bytes in place. */
+    typedef std::function<size_t(size_t)> LengthFn;
+    typedef std::function<void(size_t, char*)> RenderFn;
+
+    /* What push2Cache does with an item while the cache is over its high-water mark or the worker budget. */
+    enum OverflowPolicy {
+        OVERFLOW_BLOCK,       // Wait for the flush thread, at most the overflow wait, then drop the item.
+        OVERFLOW_DROP_NEWEST, // Drop the item being pushed.
+        OVERFLOW_DROP_OLDEST, // Drop the oldest cached item of the topic to make room.
+        OVERFLOW_SPILL        // Append the item to a spill file, written to LMDB once the flush catches up.
+    };
+
 public:
 	Producer(const std::string& root, const std::string& topic, TopicOpt* opt, size_t cacheMax = 128);
 	~Producer();
@@ -57,20 +87,63 @@ private:
 
 public:
     bool push(const BatchType& batch);
+    /* pushed: how many records were written, also when it fails partway (a batch spans chunks). */
+    bool pushReserved(size_t count, const LengthFn& lenOf, const RenderFn& render, size_t* pushed = nullptr);
 
+    bool partition(uint32_t id);
+    void setStats(ProducerStats* stats) { _stats = stats; }
+    inline bool isPartitioned() const { return _opt.partitioned; }
     bool enableBackgroundFlush(std::chrono::milliseconds flushInterval = std::chrono::milliseconds(200));
     void setCacheSize(size_t sz);
+    /* highWater: cached bytes of this producer, 0: no limit. maxWait: longest OVERFLOW_BLOCK wait, 0: none. */
+    void setOverflow(OverflowPolicy policy, size_t highWater, std::chrono::milliseconds maxWait = std::chrono::milliseconds(100));
+    /* Cached bytes of all producers of the process (the nginx worker), 0: no limit. */
+    static void setMemoryBudget(size_t bytes) { _memoryBudget = bytes; }
+    static size_t memoryUsed() { return _memoryUsed.load(std::memory_order_relaxed); }
     void push2Cache(BatchType& batch);
     void push2Cache(ItemType&& item);
     void flush();
 
 private:
     void flushWorker();
-    void flushImpl();
-
-    void openHead(Txn* txn, bool rotating = false);
+    void requestFlush();
+    void drainCache();
+    bool overBudget(size_t len) const;
+    void account(size_t len, bool add);
+    bool dropOldest();
+    bool spill(const ItemType& item);
+    void replaySpill();
+    void replayOrphanedSpills();
+    bool replayFile(const std::string& path, uint64_t* replayed = nullptr);
+    bool pushImpl(size_t count, const LengthFn& lenOf, const RenderFn& render, uint64_t* commitUs = nullptr, size_t* pushed = nullptr);
+    bool writeBatch(size_t count, const LengthFn& lenOf, const RenderFn& render, uint64_t* commitUs, size_t& written);
+    size_t chunkRoom();
+    void dropOversized(size_t len);
+    bool isBlob(size_t len) const;
+    size_t packedSize(size_t len, uint64_t blobOffset) const;
+    bool appendBlob(const RenderFn& render, size_t i, size_t len, uint64_t& offset);
+    void compressBatch(size_t count, const LengthFn& lenOf, const RenderFn& render);
+    static size_t cacheCapacity(const TopicOpt* opt, size_t cacheMax);
+
+    void openHead();
+    void followHead();
+    void selectHead(Txn* txn, bool rotating = false, uint64_t head = 0);
+    void openCurrent();
     void closeCurrent();
     void rotate();
+    MDB_env* openChunk(uint32_t file, MDB_dbi& db, ChunkFormat& format);
+    /* Counterpart of openChunk(), releases the shared env (see ChunkEnvs). */
+    static void closeChunkEnv(MDB_env* env);
+    void syncWorker();
+    void prepareNext();
+    bool adoptPrepared();
+    uint64_t chunkHead(MDB_txn* txn);
+    void checkpoint();
+    /* Drops the meta entries of the chunks past retention, oldest first. rotating: the head chunk is about to be closed. */
+    void trimChunks(Txn& txn, bool rotating, std::vector<uint32_t>& removed);
+    /* Writes the time range of the current chunk and the pending time index entry to meta. */
+    void recordTimes(Txn& txn);
+    void reapChunks(const std::vector<uint32_t>& removed);
 
 private:
     TopicOpt _opt;
@@ -79,12 +152,71 @@ private:
     uint32_t _current;
     MDB_env* _env;
     MDB_dbi _db;
+    ChunkFormat _format; // Of the current chunk, fixed when the chunk is created.
+
+    /* The chunk after the current one, opened and reserved on _prepThread once the current one is 80% full. */
+    std::thread _prepThread;
+    uint32_t _nextFile;
+    MDB_env* _nextEnv;
+    MDB_dbi _nextDb;
+    ChunkFormat _nextFormat;
+    size_t _pageSize;
+
+    /* DURABILITY_PERIODIC: _syncThread syncs _env, _envMtx keeps a rotation from closing it meanwhile. */
+    std::thread _syncThread;
+    std::mutex _envMtx, _syncMtx;
+    std::condition_variable _syncCv;
+    bool _syncRunning;
+
+    /* The head is the last key of the current chunk, __meta__ only gets a checkpoint of it. */
+    uint64_t _firstSeq, _head, _checkpointed;
+    std::chrono::steady_clock::time_point _checkpointAt;
+    uint64_t _chunkCreatedMs; // Of the current chunk, for TopicOpt::rotateIntervalMs.
+    uint64_t _chunkMinMs, _chunkMaxMs; // Commit times of this producer's batches in the current chunk.
+    uint64_t _indexMs, _indexSeq; // First batch since the last checkpoint, 0: none.
 
     std::chrono::milliseconds _flushInterval;
     bool _bgEnabled, _bgRunning;
     std::thread _bgFlush;
     std::condition_variable _bgCv;
-    std::mutex _cacheMtx, _flushMtx;
-    size_t _cacheMax; // Default: 100
-    BatchType _cache0, _cache1, *_cacheCurrent;
+    std::mutex _flushMtx, _drainMtx, _writeMtx, _popMtx;
+
+    /* Items go through a lock-free queue, only the draining thread batches them. */
+    std::atomic<size_t> _cacheMax; // Default: 128
+    std::atomic<int64_t> _cacheSize; // Signed: a drain may pop an item before its pusher counted it.
+    std::atomic<size_t> _cacheBytes;
+    std::atomic<bool> _flushRequested;
+    MpscQueue<ItemType> _cache;
+    BatchType _flushBatch;
+    std::unique_ptr<FlushController> _flushCtl; // Set when opt.flushTargetUs is, replaces the cacheMax / interval policy.
+
+    ProducerStats* _stats; // Optional, usually shared by the producers of all workers.
+
+    /* Batch packed and compressed by compressBatch() before the chunk write lock is taken. */
+    std::string _packBuf, _zipped;
+
+    /* Blob file of the current chunk, appended under the chunk write lock. */
+    FILE* _blobFile;
+    uint32_t _blobChunk;
+    std::string _blobBuf;
+    std::vector<uint64_t> _blobOffsets;
+
+    OverflowPolicy _overflow;
+    size_t _highWater;
+    std::chrono::milliseconds _overflowWait;
+    static size_t _memoryBudget;
+    static std::atomic<size_t> _memoryUsed;
+
+    /*
+     * Spill file "<root>/<topic>.spill.<pid>", len32 framed records (replayFile() turns the ones
+     * it wrote before a failure into a skipped span). It is flock()ed while open, and so is
+     * "<spill file>.replay" until it is written to LMDB (_replayFile): the files of exited
+     * processes are the unlocked ones, see replayOrphanedSpills().
+     */
+    std::mutex _spillMtx;
+    std::string _spillPath;
+    FILE* _spillFile;
+    FILE* _replayFile;
+    std::atomic<size_t> _spillCount;
+    bool _orphansChecked;
 };
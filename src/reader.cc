@@ -0,0 +1,88 @@
+#include "topic.h"
+#include "reader.h"
+
+using namespace std;
+
+static const size_t READ_BATCH = 64;
+
+Reader::Reader(Topic* topic, uint64_t from) : _consumer(topic, from), _first(0), _pos(0) {
+}
+
+bool Reader::next(uint64_t& seq, MDB_val& val) {
+    if (_pos == _batch.size()) {
+        _pos = 0;
+        if (!_consumer.pull(READ_BATCH, _batch, _first, &_times)) return false;
+    }
+
+    seq = _first + _pos;
+    val = _batch[_pos++];
+    return true;
+}
+
+MergedReader::MergedReader(Topic* topic, const string& consumer) : _topic(topic), _consumer(consumer) {
+    refresh();
+}
+
+void MergedReader::refresh() {
+    Txn txn(_topic->getEnv(), NULL, true);
+    vector<uint32_t> ids = _topic->getPartitions(txn);
+    txn.abort();
+
+    for (uint32_t id : ids) {
+        bool known = false;
+        for (auto& source : _sources) known = known || source.id == id;
+        if (known) continue;
+
+        Topic* partition = _topic->getPartition(id);
+
+        Txn ptxn(partition->getEnv(), NULL, true);
+        uint64_t head = partition->getConsumerHead(ptxn, _consumer);
+        ptxn.abort();
+
+        Source source;
+        source.id = id;
+        source.reader.reset(new Reader(partition, head));
+        source.peeked = false;
+        source.seq = 0;
+        source.val = MDB_val{ 0, nullptr };
+        source.ms = 0;
+        _sources.push_back(std::move(source));
+    }
+}
+
+bool MergedReader::next(uint32_t& partition, uint64_t& seq, MDB_val& val) {
+    Source* best = nullptr;
+
+    for (auto& source : _sources) {
+        if (!source.peeked) {
+            source.peeked = source.reader->next(source.seq, source.val);
+            if (source.peeked && source.reader->time()) source.ms = source.reader->time();
+        }
+        if (source.peeked && (!best || source.ms < best->ms)) best = &source;
+    }
+
+    if (!best) {
+        /* Partitions created by new workers show up once the known ones are drained. */
+        size_t known = _sources.size();
+        refresh();
+        return _sources.size() > known ? next(partition, seq, val) : false;
+    }
+
+    best->peeked = false;
+    partition = best->id;
+    seq = best->seq;
+    val = best->val;
+    return true;
+}
+
+void MergedReader::commit() {
+    Txn txn(_topic->getEnv(), NULL);
+
+    for (auto& source : _sources) {
+        /* A peeked message has not been returned yet, it stays unconsumed. */
+        uint64_t head = source.peeked ? source.seq : source.reader->position();
+        source.reader->getTopic()->setConsumerHead(txn, _consumer, head);
+    }
+
+    txn.commit();
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <string>
+
+#include <lmdb/lmdb.h>
+#include "consumer.h"
+
+class Topic;
+
+/*
+ * Sequential reader of one chunk series, one message at a time on top of Consumer. Batch
+ * records are unpacked transparently, every message still has its own sequence, and blobs are
+ * read back from the chunk's blob file.
+ */
+class Reader {
+public:
+    Reader(Topic* topic, uint64_t from);
+
+private:
+    Reader(const Reader&);
+    Reader& operator=(const Reader&);
+
+public:
+    /* Next message, false when the producer head is reached. val stays valid until the next call. */
+    bool next(uint64_t& seq, MDB_val& val);
+    /* Commit time of the message last returned by next(), 0: not recorded (the chunk is not timed). */
+    inline uint64_t time() const { return _pos ? _times[_pos - 1] : 0; }
+
+    inline Topic* getTopic() { return _consumer.getTopic(); }
+    // Sequence of the next message to read.
+    inline uint64_t position() const { return _pos < _batch.size() ? _first + _pos : _consumer.position(); }
+
+private:
+    Consumer _consumer;
+    std::vector<MDB_val> _batch; // Last pull, next() hands it out one by one.
+    std::vector<uint64_t> _times;
+    uint64_t _first;
+    size_t _pos;
+};
+
+/*
+ * Merged view over every partition of a partitioned topic, ordered by batch commit time (ties
+ * go to the lower partition id); each partition stays in sequence order. A message without a
+ * recorded time (chunks written without TopicOpt::batched) takes the time of the message before
+ * it in its partition. Positions are the consumer heads of `consumer`.
+ */
+class MergedReader {
+public:
+    MergedReader(Topic* topic, const std::string& consumer);
+
+private:
+    MergedReader(const MergedReader&);
+    MergedReader& operator=(const MergedReader&);
+
+public:
+    bool next(uint32_t& partition, uint64_t& seq, MDB_val& val);
+
+    /* Stores the position of every partition as its consumer head. */
+    void commit();
+
+private:
+    struct Source {
+        uint32_t id;
+        std::unique_ptr<Reader> reader;
+        bool peeked;
+        uint64_t seq;
+        MDB_val val;
+        uint64_t ms; // Commit time of the peeked message.
+    };
+
+    void refresh();
+
+private:
+    Topic* _topic;
+    std::string _consumer;
+    std::vector<Source> _sources;
+};
@@ -0,0 +1,190 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <iostream>
+#include <functional>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "reaper.h"
+
+using namespace std;
+
+Reaper& Reaper::instance() {
+    static Reaper instance;
+    return instance;
+}
+
+Reaper::Reaper(size_t stepBytes, chrono::milliseconds stepPause) : _stepBytes(stepBytes), _stepPause(stepPause), _running(false) {
+}
+
+Reaper::~Reaper() {
+    {
+        unique_lock<mutex> lck(_mtx);
+        _running = false;
+        _cv.notify_one();
+    }
+
+    if (_thread.joinable()) _thread.join();
+}
+
+void Reaper::add(const string& path, ProducerStats* stats) {
+    uint64_t bytes = 0;
+    string files[] = { path, path + ".blob" };
+    for (const string& file : files) {
+        struct stat st;
+        if (stat(file.c_str(), &st) == 0) {
+#ifdef _WIN32
+            bytes += st.st_size;
+#else
+            bytes += uint64_t(st.st_blocks) * 512;
+#endif
+        }
+    }
+
+    if (stats) stats->reapPendingBytes.fetch_add(int64_t(bytes), memory_order_relaxed);
+
+    unique_lock<mutex> lck(_mtx);
+    _jobs.push_back(Job{ path, bytes, stats });
+
+    /* Started on first use: the nginx master never removes chunks, only its forked workers do. */
+    if (!_running) {
+        _running = true;
+        _thread = thread(bind(&Reaper::work, this));
+    }
+    _cv.notify_one();
+}
+
+uint64_t Reaper::pendingBytes() {
+    unique_lock<mutex> lck(_mtx);
+    uint64_t ret = 0;
+    for (const Job& job : _jobs) ret += job.bytes;
+    return ret;
+}
+
+bool Reaper::pin(const string& path) {
+    lock_guard<mutex> guard(_pinMtx);
+    if (_reaping.count(path)) return false;
+
+    ++_pinned[path];
+    return true;
+}
+
+void Reaper::unpin(const string& path) {
+    lock_guard<mutex> guard(_pinMtx);
+    auto it = _pinned.find(path);
+    if (it != _pinned.end() && --it->second == 0) _pinned.erase(it);
+}
+
+void Reaper::work() {
+    unique_lock<mutex> lck(_mtx);
+    for (;;) {
+        _cv.wait(lck, [this]() { return !_jobs.empty() || !_running; });
+        if (_jobs.empty()) return;
+
+        Job job = _jobs.front();
+        _jobs.pop_front();
+
+        /* Once stopping, the rest is unlinked without throttling. */
+        bool throttled = _running;
+        lck.unlock();
+        reap(job, throttled);
+        lck.lock();
+    }
+}
+
+void Reaper::reap(const Job& job, bool throttled) {
+    string lockPath = job.path + "-lock";
+    uint64_t reclaimed = 0;
+
+    /* Open here: unlinked only, the map stays valid until the env is closed. Otherwise nobody here opens it until it is gone. */
+    bool pinned;
+    {
+        lock_guard<mutex> guard(_pinMtx);
+        pinned = _pinned.count(job.path) != 0;
+        if (!pinned) _reaping.insert(job.path);
+    }
+
+#ifndef _WIN32
+    /*
+     * Every other process with the env open holds a read lock on byte 0 of the lock file (see
+     * mdb_env_excl_lock), shrinking the file under its map would SIGBUS it. Holding the write
+     * lock keeps new openers out until the file is gone.
+     */
+    int lfd = -1;
+    bool unused = false;
+    if (!pinned) {
+        lfd = open(lockPath.c_str(), O_RDWR);
+        struct flock excl;
+        memset(&excl, 0, sizeof(excl));
+        excl.l_type = F_WRLCK;
+        excl.l_whence = SEEK_SET;
+        excl.l_len = 1;
+        unused = lfd < 0 || fcntl(lfd, F_SETLK, &excl) == 0;
+    }
+
+    if (unused && throttled) {
+        shrink(job.path, job, reclaimed);
+        shrink(job.path + ".blob", job, reclaimed);
+    }
+#endif
+
+    if (remove(job.path.c_str()) != 0 && errno != ENOENT) {
+        cout << "LMDB_QUEUE WARNING: Cannot remove " << job.path << ": " << strerror(errno) << endl;
+    }
+    string blobPath = job.path + ".blob";
+    if (remove(blobPath.c_str()) != 0 && errno != ENOENT) {
+        cout << "LMDB_QUEUE WARNING: Cannot remove " << blobPath << ": " << strerror(errno) << endl;
+    }
+    remove(lockPath.c_str());
+
+#ifndef _WIN32
+    if (lfd >= 0) close(lfd);
+#endif
+
+    if (!pinned) {
+        lock_guard<mutex> guard(_pinMtx);
+        _reaping.erase(job.path);
+    }
+
+    if (job.stats) {
+        uint64_t rest = job.bytes > reclaimed ? job.bytes - reclaimed : 0;
+        job.stats->reclaimedBytes.fetch_add(rest, memory_order_relaxed);
+        job.stats->reapPendingBytes.fetch_sub(int64_t(rest), memory_order_relaxed);
+        job.stats->reapedChunks.fetch_add(1, memory_order_relaxed);
+    }
+}
+
+void Reaper::shrink(const string& path, const Job& job, uint64_t& reclaimed) {
+#ifndef _WIN32
+    int fd = open(path.c_str(), O_RDWR);
+    if (fd < 0) return;
+
+    struct stat st;
+    off_t size = fstat(fd, &st) == 0 ? st.st_size : 0;
+    while (size > 0) {
+        size = size > off_t(_stepBytes) ? size - off_t(_stepBytes) : 0;
+        if (ftruncate(fd, size) != 0) {
+            cout << "LMDB_QUEUE WARNING: Cannot truncate " << path << ": " << strerror(errno) << endl;
+            break;
+        }
+
+        struct stat now;
+        if (fstat(fd, &now) == 0 && job.stats) {
+            /* Blocks freed by this step, a job's files are shrunk one after the other. */
+            uint64_t before = uint64_t(st.st_blocks) * 512, left = uint64_t(now.st_blocks) * 512;
+            uint64_t freed = before > left ? before - left : 0;
+            st.st_blocks = now.st_blocks;
+            reclaimed += freed;
+            job.stats->reclaimedBytes.fetch_add(freed, memory_order_relaxed);
+            job.stats->reapPendingBytes.fetch_sub(int64_t(freed), memory_order_relaxed);
+        }
+
+        if (size > 0) this_thread::sleep_for(_stepPause);
+    }
+    close(fd);
+#endif
+}
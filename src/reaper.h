@@ -0,0 +1,71 @@
+#pragma once
+
+#include <thread>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <set>
+#include <string>
+#include <stdint.h>
+
+#include "stats.h"
+
+/*
+ * Deletes removed chunk files on a background thread, after the meta commit that dropped them.
+ * A chunk no process has open is shrunk in throttled ftruncate steps before the unlink, so the
+ * filesystem frees its extents a slice at a time instead of in one long stall.
+ *
+ * Truncating is only safe because every chunk env is opened with its lock file (no MDB_NOLOCK):
+ * other processes show up as read locks on it, which the Reaper's write lock probes. Locks of
+ * this process never conflict with its own, so chunk envs opened here are pinned instead, and a
+ * pinned chunk is only unlinked; its lock file is not even opened, as closing that descriptor
+ * would drop the env's lock. ChunkEnvs does both, open chunks through it only.
+ */
+class Reaper {
+public:
+    static Reaper& instance();
+
+    Reaper(size_t stepBytes = 64 * 1024 * 1024, std::chrono::milliseconds stepPause = std::chrono::milliseconds(20));
+    ~Reaper();
+
+private:
+    Reaper(const Reaper&);
+    Reaper& operator=(const Reaper&);
+
+public:
+    /* path: the chunk data file, its "-lock" and ".blob" files go too. stats is optional. */
+    void add(const std::string& path, ProducerStats* stats);
+    /* Disk space of the queued chunks, not freed yet. */
+    uint64_t pendingBytes();
+
+    /* Around every chunk env of this process: before the open, after the close. false: being reaped, don't open it. */
+    bool pin(const std::string& path);
+    void unpin(const std::string& path);
+
+private:
+    struct Job {
+        std::string path;
+        uint64_t bytes;
+        ProducerStats* stats;
+    };
+
+    void work();
+    void reap(const Job& job, bool throttled);
+    void shrink(const std::string& path, const Job& job, uint64_t& reclaimed);
+
+private:
+    const size_t _stepBytes;
+    const std::chrono::milliseconds _stepPause;
+
+    std::mutex _mtx;
+    std::condition_variable _cv;
+    std::deque<Job> _jobs;
+    bool _running;
+    std::thread _thread;
+
+    std::mutex _pinMtx;
+    std::map<std::string, int> _pinned; // Chunk files with an env open in this process, and how many.
+    std::set<std::string> _reaping;
+};
@@ -0,0 +1,232 @@
+#ifdef _WIN32
+#include <windows.h>
+#include <process.h>
+#else
+#include <signal.h>
+#include <unistd.h>
+#endif
+
+#include <errno.h>
+#include <string.h>
+#include <chrono>
+#include <new>
+#include <iostream>
+
+#include "producer.h"
+#include "ring.h"
+
+using namespace std;
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "Ring needs address-free 64 bit atomics.");
+
+/*
+ * Record header: payload length << 2 | state, then the pid of the reserving process. Padding
+ * only has the first word, with its whole size instead of a payload length. Records and
+ * headers are 8 byte aligned.
+ */
+enum RingState : uint64_t {
+    RING_FREE = 0,
+    RING_WRITING = 1,
+    RING_COMMITTED = 2,
+    RING_PAD = 3
+};
+
+static const uint64_t ringHeaderSize = 2 * sizeof(uint64_t);
+static const int64_t ringStallCheckMs = 1000;
+
+static inline uint64_t ringAlign(uint64_t len) { return (len + 7) & ~uint64_t(7); }
+
+static int64_t nowMs() {
+    return chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static int64_t currentPid() {
+#ifdef _WIN32
+    return _getpid();
+#else
+    return getpid();
+#endif
+}
+
+static bool pidAlive(int64_t pid) {
+#ifdef _WIN32
+    return true; // No cheap liveness probe, never steal the ring.
+#else
+    return kill(pid_t(pid), 0) == 0 || errno != ESRCH;
+#endif
+}
+
+Ring::Ring() : _head(0), _tail(0), _owner(0), _full(0), _abandoned(0), _capacity(0), _stallPos(uint64_t(-1)), _stallSince(0) {
+}
+
+Ring* Ring::create(void* mem, size_t size) {
+    if (size < sizeof(Ring) + 1024) return nullptr;
+
+    Ring* ring = new (mem) Ring();
+    ring->_capacity = (size - sizeof(Ring)) & ~uint64_t(7);
+    memset(ring->data(), 0, ring->_capacity);
+    return ring;
+}
+
+char* Ring::reserve(size_t len, uint64_t& pos) {
+    uint64_t need = ringHeaderSize + ringAlign(len);
+    if (need > _capacity / 2) {
+        _full.fetch_add(1, memory_order_relaxed);
+        return nullptr;
+    }
+
+    uint64_t head = _head.load(memory_order_relaxed), pad;
+    for (;;) {
+        /* Records never wrap: the tail of the buffer is padded and the record starts at offset 0. */
+        uint64_t off = head % _capacity;
+        pad = off + need > _capacity ? _capacity - off : 0;
+
+        if (head + pad + need - _tail.load(memory_order_acquire) > _capacity) {
+            _full.fetch_add(1, memory_order_relaxed);
+            return nullptr;
+        }
+
+        if (_head.compare_exchange_weak(head, head + pad + need, memory_order_acq_rel, memory_order_relaxed)) break;
+    }
+
+    if (pad) headerAt(head)->store((pad << 2) | RING_PAD, memory_order_release);
+
+    /* The pid is visible before the state, the drainer reads it once it sees RING_WRITING. */
+    pos = head + pad;
+    (headerAt(pos) + 1)->store(uint64_t(currentPid()), memory_order_relaxed);
+    headerAt(pos)->store((uint64_t(len) << 2) | RING_WRITING, memory_order_release);
+    return data() + pos % _capacity + ringHeaderSize;
+}
+
+void Ring::commit(uint64_t pos) {
+    std::atomic<uint64_t>* header = headerAt(pos);
+    header->store((header->load(memory_order_relaxed) & ~uint64_t(3)) | RING_COMMITTED, memory_order_release);
+}
+
+void Ring::discard(uint64_t pos) {
+    std::atomic<uint64_t>* header = headerAt(pos);
+    uint64_t len = header->load(memory_order_relaxed) >> 2;
+    header->store(((ringHeaderSize + ringAlign(len)) << 2) | RING_PAD, memory_order_release);
+}
+
+bool Ring::tryOwn(int64_t pid) {
+    int64_t owner = _owner.load(memory_order_acquire);
+    if (owner == pid) return true;
+    if (owner != 0 && pidAlive(owner)) return false;
+
+    return _owner.compare_exchange_strong(owner, pid, memory_order_acq_rel);
+}
+
+void Ring::disown(int64_t pid) {
+    _owner.compare_exchange_strong(pid, 0, memory_order_acq_rel);
+}
+
+void Ring::release(uint64_t from, uint64_t to) {
+    /* Headers may land anywhere in the released range later, so it must read back as RING_FREE. */
+    while (from < to) {
+        uint64_t off = from % _capacity;
+        uint64_t len = min(to - from, _capacity - off);
+        memset(data() + off, 0, len);
+        from += len;
+    }
+
+    _tail.store(to, memory_order_release);
+}
+
+bool Ring::drain(Producer* producer, size_t maxRecords, size_t& drained) {
+    static thread_local vector<pair<const char*, size_t> > records;
+    static thread_local vector<uint64_t> starts;
+    records.clear();
+    starts.clear();
+    drained = 0;
+
+    uint64_t tail = _tail.load(memory_order_relaxed), end = tail;
+    uint64_t head = _head.load(memory_order_acquire);
+
+    while (end < head && records.size() < maxRecords) {
+        uint64_t word = headerAt(end)->load(memory_order_acquire);
+        uint64_t len = word >> 2;
+
+        switch (word & 3) {
+        case RING_PAD:
+            end += len;
+            continue;
+        case RING_COMMITTED:
+            records.push_back(make_pair(data() + end % _capacity + ringHeaderSize, size_t(len)));
+            starts.push_back(end);
+            end += ringHeaderSize + ringAlign(len);
+            _stallPos = uint64_t(-1);
+            continue;
+        case RING_WRITING: {
+            /*
+             * Slow producers (e.g. reading a large spooled body) are waited for. The record is
+             * only skipped once its process is gone, which also keeps its space from being reused
+             * under a producer that is still rendering into it.
+             */
+            int64_t pid = int64_t((headerAt(end) + 1)->load(memory_order_relaxed));
+            if (_stallPos != end) {
+                _stallPos = end;
+                _stallSince = nowMs();
+            } else if (nowMs() - _stallSince > ringStallCheckMs) {
+                if (!pidAlive(pid)) {
+                    cout << "LMDB_QUEUE WARNING: Ring record abandoned by exited process " << pid << ", skipped." << endl;
+                    _abandoned.fetch_add(1, memory_order_relaxed);
+                    end += ringHeaderSize + ringAlign(len);
+                    _stallPos = uint64_t(-1);
+                    continue;
+                }
+                _stallSince = nowMs();
+            }
+            break;
+        }
+        default:
+            break; // Reserved, header not published yet.
+        }
+
+        break;
+    }
+
+    if (!records.empty()) {
+        /* A failed write keeps what was not written in the ring, the next drain retries it. */
+        bool ok = producer->pushReserved(records.size(),
+            [](size_t i) { return records[i].second; },
+            [](size_t i, char* dst) { memcpy(dst, records[i].first, records[i].second); },
+            &drained);
+        if (!ok) {
+            if (drained < records.size()) end = starts[drained];
+            if (end > tail) release(tail, end);
+            return false;
+        }
+    }
+
+    if (end > tail) release(tail, end);
+    return true;
+}
+
+RingWriter::RingWriter(Ring* ring, Producer* producer, size_t batchMax) : _ring(ring), _producer(producer), _batchMax(batchMax), _running(true) {
+    _thread = thread(bind(&RingWriter::work, this));
+}
+
+RingWriter::~RingWriter() {
+    _running = false;
+    _thread.join();
+    _ring->disown(currentPid());
+}
+
+void RingWriter::work() {
+    int64_t pid = currentPid();
+
+    while (_running) {
+        if (!_ring->tryOwn(pid)) {
+            this_thread::sleep_for(chrono::milliseconds(100));
+            continue;
+        }
+
+        size_t drained;
+        if (!_ring->drain(_producer, _batchMax, drained)) {
+            this_thread::sleep_for(chrono::milliseconds(100));
+        } else if (drained == 0) {
+            this_thread::sleep_for(chrono::milliseconds(1));
+        }
+    }
+}
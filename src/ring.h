@@ -0,0 +1,83 @@
+#pragma once
+
+#include <atomic>
+#include <thread>
+#include <functional>
+#include <vector>
+#include <stdint.h>
+
+class Producer;
+
+/*
+ * Multi-producer byte ring placed in memory shared by several processes (an nginx shm zone).
+ * Producers reserve space with a CAS on the write cursor, render the record in place and
+ * publish its header; a single drainer, elected through the owner pid, moves committed
+ * records into LMDB in large transactions. A record is only released once it is written.
+ */
+class Ring {
+public:
+    /* Lays out a fresh ring in `mem`, `size` bytes including this header. */
+    static Ring* create(void* mem, size_t size);
+    static size_t overhead() { return sizeof(Ring); }
+
+private:
+    Ring();
+    Ring(const Ring&);
+    Ring& operator=(const Ring&);
+
+public:
+    /* Producer side: nullptr when the ring is full or the record cannot fit at all. */
+    char* reserve(size_t len, uint64_t& pos);
+    void commit(uint64_t pos);
+    /* Gives up a reservation, the drainer skips it like padding. */
+    void discard(uint64_t pos);
+
+    /* Drainer side. */
+    bool tryOwn(int64_t pid);
+    void disown(int64_t pid);
+    /* Writes up to maxRecords committed records. false: the write failed, the unwritten ones stay in the ring. */
+    bool drain(Producer* producer, size_t maxRecords, size_t& drained);
+
+    inline uint64_t capacity() const { return _capacity; }
+    inline uint64_t used() const { return _head.load(std::memory_order_relaxed) - _tail.load(std::memory_order_relaxed); }
+    inline uint64_t fullCount() const { return _full.load(std::memory_order_relaxed); }
+    inline uint64_t abandonedCount() const { return _abandoned.load(std::memory_order_relaxed); }
+
+private:
+    inline std::atomic<uint64_t>* headerAt(uint64_t pos) { return (std::atomic<uint64_t>*)(data() + pos % _capacity); }
+    inline char* data() { return (char*)(this + 1); }
+    void release(uint64_t from, uint64_t to);
+
+private:
+    std::atomic<uint64_t> _head; // Bytes reserved by producers (monotonic).
+    std::atomic<uint64_t> _tail; // Bytes released by the drainer (monotonic).
+    std::atomic<int64_t> _owner; // Pid of the drainer, 0: none.
+    std::atomic<uint64_t> _full, _abandoned;
+    uint64_t _capacity;
+
+    /* Drainer-local stall tracking: a record still being written is skipped once its process is gone. */
+    uint64_t _stallPos;
+    int64_t _stallSince;
+};
+
+/* Background thread draining a Ring into a Producer while it holds the ring ownership. */
+class RingWriter {
+public:
+    RingWriter(Ring* ring, Producer* producer, size_t batchMax = 4096);
+    ~RingWriter();
+
+private:
+    RingWriter(const RingWriter&);
+    RingWriter& operator=(const RingWriter&);
+
+private:
+    void work();
+
+private:
+    Ring* _ring;
+    Producer* _producer;
+    size_t _batchMax;
+
+    std::atomic<bool> _running;
+    std::thread _thread;
+};
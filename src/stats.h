@@ -0,0 +1,69 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Runtime counters of one topic. Plain atomics only, so a zeroed block of shared memory is a
+ * valid instance and producers of every worker can update the same one.
+ */
+struct LatencyHistogram {
+    /* Bucket i counts samples of [2^(i-1), 2^i) microseconds, bucket 0 the sub-microsecond ones. */
+    static const size_t bucketCount = 32;
+
+    std::atomic<uint64_t> buckets[bucketCount];
+    std::atomic<uint64_t> count, sumUs;
+
+    void record(uint64_t us) {
+        size_t bucket = 0;
+        while (bucket < bucketCount - 1 && (us >> bucket) != 0) ++bucket;
+
+        buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+        count.fetch_add(1, std::memory_order_relaxed);
+        sumUs.fetch_add(us, std::memory_order_relaxed);
+    }
+};
+
+struct ProducerStats {
+    std::atomic<uint64_t> pushes, bytes, flushes, mapFullRetries, rotations;
+    std::atomic<uint64_t> preparedRotations; // Rotations that swapped in a chunk prepared in the background.
+    std::atomic<uint64_t> splitBatches; // Batches written across a chunk boundary.
+    std::atomic<uint64_t> dropped, spilled, blocked; // Overflow handling, see Producer::setOverflow().
+    std::atomic<uint64_t> spillRecovered; // Records written from spill files left by exited processes.
+    std::atomic<uint64_t> reapedChunks, reclaimedBytes; // Chunk files deleted by the Reaper.
+    std::atomic<uint64_t> lowDiskTrims; // Chunks removed before their time for TopicOpt::minFreeBytes.
+    std::atomic<uint64_t> storedBytes; // Record values written to LMDB, after batch packing and compression.
+    std::atomic<uint64_t> blobBytes; // Messages written to blob files instead.
+    std::atomic<int64_t> cacheDepth;
+    std::atomic<int64_t> reapPendingBytes; // Disk space of removed chunks the Reaper has not freed yet.
+
+    LatencyHistogram cacheWait; // push2Cache() until an item is queued, including overflow waits and drops of older items.
+    LatencyHistogram txnBuild;  // Writer locks plus mdb_put of a whole batch.
+    LatencyHistogram commit;    // txn.commit().
+    LatencyHistogram rotate;    // Producer::rotate().
+    LatencyHistogram sync;      // mdb_env_sync() of the periodic mode, the commit itself in the synced modes.
+
+    void reset() { memset((void*)this, 0, sizeof(*this)); }
+};
+
+/* Times a section only when stats are collected, so disabled stats cost a branch. */
+class StatsTimer {
+public:
+    explicit StatsTimer(const ProducerStats* stats) : _enabled(stats != nullptr) {
+        if (_enabled) _start = std::chrono::steady_clock::now();
+    }
+
+    void record(LatencyHistogram& hist) {
+        if (!_enabled) return;
+
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        hist.record(std::chrono::duration_cast<std::chrono::microseconds>(now - _start).count());
+        _start = now;
+    }
+
+private:
+    bool _enabled;
+    std::chrono::steady_clock::time_point _start;
+};
@@ -1,12 +1,55 @@
 #include <string.h>
+#include <sys/stat.h>
+#include <algorithm>
 
 #include "topic.h"
+#include "batch.h"
 
 using namespace std;
 
 const char* keyProducerStr = "producer_head";
 const char* prefixConsumerStr = "consumer_head_";
 const char* keyConsumerStr = "consumer_head_%s";
+const char* keyPartitionsStr = "partitions";
+const char* prefixGroupStr = "group_%s/";
+
+/* Time index keys: 't' and the big endian time, so that memcmp (see descCmp) orders them by time. */
+const size_t timeKeySize = 9;
+
+static void timeKey(char* buf, uint64_t ms) {
+    buf[0] = 't';
+    for (int i = 8; i > 0; --i, ms >>= 8) buf[i] = char(ms & 0xff);
+}
+
+static bool isTimeKey(const MDB_val& key) {
+    return key.mv_size == timeKeySize && ((const char*)key.mv_data)[0] == 't';
+}
+
+/* Lease keys: "group_<group>/" and the big endian start, so that memcmp orders a group's ranges by start. */
+static string leaseKey(const string& group, uint64_t start) {
+    char prefix[4096];
+    int len = sprintf(prefix, prefixGroupStr, group.c_str());
+
+    string ret(prefix, len);
+    for (int shift = 56; shift >= 0; shift -= 8) ret += char((start >> shift) & 0xff);
+    return ret;
+}
+
+static ChunkMeta chunkMeta(const MDB_val& val) {
+    ChunkMeta ret = { 0, 0, 0, 0, 0, 0 };
+    memcpy(&ret, val.mv_data, min(val.mv_size, sizeof(ret)));
+    return ret;
+}
+
+static uint64_t fileDiskBytes(const char* path) {
+    struct stat fst;
+    if (stat(path, &fst) != 0) return 0;
+#ifdef _WIN32
+    return fst.st_size;
+#else
+    return uint64_t(fst.st_blocks) * 512;
+#endif
+}
 
 int descCmp(const MDB_val *a, const MDB_val *b) {
     /* DESC order in size */
@@ -44,15 +87,65 @@ Topic::Topic(Env* env, const string& name) : _env(env), _name(name) {
     rc = mdb_put(txn.getEnvTxn(), _desc, &key, &val, MDB_NOOVERWRITE);
 
     if (rc == 0) {
+        ChunkMeta meta = { 0, wallClockMs(), 0, 0, 0, 0 };
         uint32_t headFile = 0;
         key.mv_data = &headFile;
         key.mv_size = sizeof(headFile);
+        val.mv_data = &meta;
+        val.mv_size = sizeof(meta);
         mdb_put(txn.getEnvTxn(), _desc, &key, &val, MDB_NOOVERWRITE);
     }
 
     txn.commit();
 }
 
+void Topic::migrate(Env* from, Env* to, const string& name) {
+    Txn dst(to, NULL);
+    MDB_dbi dstDb, srcDb;
+    bool migrated = mdb_dbi_open(dst.getEnvTxn(), name.c_str(), 0, &dstDb) == 0;
+
+    Txn src(from, NULL);
+    if (mdb_dbi_open(src.getEnvTxn(), name.c_str(), 0, &srcDb) != 0) return;
+    mdb_set_compare(src.getEnvTxn(), srcDb, descCmp);
+
+    if (!migrated) {
+        mdb_dbi_open(dst.getEnvTxn(), name.c_str(), MDB_CREATE, &dstDb);
+        mdb_set_compare(dst.getEnvTxn(), dstDb, descCmp);
+
+        MDBCursor cur(srcDb, src.getEnvTxn());
+        for (int rc = cur.gotoFirst(); rc == 0; rc = cur.next()) {
+            MDB_val key = cur.key(), val = cur.val();
+            rc = mdb_put(dst.getEnvTxn(), dstDb, &key, &val, MDB_APPEND);
+            if (rc != 0) {
+                printf("Topic migrate error.\n%s\n", mdb_strerror(rc));
+                return;
+            }
+        }
+
+        int rc = dst.commit();
+        if (rc != 0) {
+            printf("Topic migrate error.\n%s\n", mdb_strerror(rc));
+            return;
+        }
+    }
+
+    /* Only dropped once the copy is committed, a crash in between leaves a stale copy that the next open drops. */
+    mdb_drop(src.getEnvTxn(), srcDb, 1);
+    src.commit();
+}
+
+void Topic::reopen() {
+    Txn txn(_env, NULL);
+    int rc = mdb_dbi_open(txn.getEnvTxn(), _name.c_str(), MDB_CREATE, &_desc);
+    if (rc != 0) {
+        printf("Topic open error.\n%s\n", mdb_strerror(rc));
+        return;
+    }
+
+    mdb_set_compare(txn.getEnvTxn(), _desc, descCmp);
+    txn.commit();
+}
+
 Topic::~Topic() {
     mdb_dbi_close(_env->getMdbEnv(), _desc);
 }
@@ -65,12 +158,16 @@ bool checkConsumerKeyPrefix(const MDB_val& val) {
 TopicStatus Topic::status() {
     TopicStatus ret;
 
-    Txn txn(_env, NULL);
+    /* Read-only: a scrape must never wait for (or block) the meta writer. */
+    Txn txn(_env, NULL, true);
     ret.producerHead = getProducerHead(txn);
 
+    /* Named keys come first (longest first), consumer heads are mixed with lease keys of the same size. */
     MDBCursor cur(_desc, txn.getEnvTxn());
-    int rc = cur.gotoFirst();
-    while (rc == 0 && checkConsumerKeyPrefix(cur.key())) {
+    int rc;
+    for (rc = cur.gotoFirst(); rc == 0 && cur.key().mv_size > timeKeySize; rc = cur.next()) {
+        if (!checkConsumerKeyPrefix(cur.key())) continue;
+
         char name[4096];
         size_t nameLen = cur.key().mv_size - strlen(prefixConsumerStr);
         const char* namePtr = ((const char*)cur.key().mv_data) + strlen(prefixConsumerStr);
@@ -78,7 +175,32 @@ TopicStatus Topic::status() {
         name[nameLen] = 0;
 
         ret.consumerHeads[name] = cur.val<uint64_t>();
-        rc = cur.next();
+    }
+
+    ret.partitions = getPartitions(txn);
+
+    for (rc = cur.gte(uint32_t(0)); rc == 0 && cur.key().mv_size == sizeof(uint32_t); rc = cur.next()) {
+        ChunkMeta meta = chunkMeta(cur.val());
+        ChunkStatus chunk = { cur.key<uint32_t>(), meta.firstSeq, 0, 0, 0, 0, 0, 0, meta.createdMs, meta.closedMs, meta.minMs, meta.maxMs };
+        ret.chunks.push_back(chunk);
+    }
+
+    txn.abort();
+
+    /* Until the chunk itself is read (it may be gone already): it ends where the next one starts, the head chunk at the checkpoint. */
+    for (size_t i = 0; i < ret.chunks.size(); ++i) {
+        ChunkStatus& chunk = ret.chunks[i];
+        chunk.lastSeq = i + 1 < ret.chunks.size() ? ret.chunks[i + 1].firstSeq - 1 : ret.producerHead;
+        uint64_t first = max(chunk.firstSeq, uint64_t(1));
+        if (chunk.lastSeq < first) chunk.lastSeq = 0;
+        chunk.entries = chunk.lastSeq ? chunk.lastSeq - first + 1 : 0;
+
+        statChunk(chunk);
+    }
+
+    /* The meta head is a checkpoint, the head chunk may already hold newer records. */
+    if (!ret.chunks.empty()) {
+        ret.producerHead = max(ret.producerHead, ret.chunks.back().lastSeq);
     }
 
     return ret;
@@ -91,8 +213,9 @@ uint32_t Topic::getProducerHeadFile(Txn& txn) {
 }
 
 void Topic::setProducerHeadFile(Txn& txn, uint32_t file, uint64_t offset) {
+    ChunkMeta meta = { offset, wallClockMs(), 0, 0, 0, 0 };
     MDB_val key{ sizeof(file), &file},
-            val{ sizeof(offset), &offset };
+            val{ sizeof(meta), &meta };
 
     mdb_put(txn.getEnvTxn(), _desc, &key, &val, 0);
 }
@@ -112,6 +235,13 @@ void Topic::setProducerHead(Txn& txn, uint64_t head) {
     mdb_put(txn.getEnvTxn(), _desc, &key, &val, 0);
 }
 
+void Topic::checkpointProducerHead(Txn& txn, uint64_t head) {
+    /* Producers of every worker checkpoint the same key, it only moves forward. */
+    if (getProducerHead(txn) < head) {
+        setProducerHead(txn, head);
+    }
+}
+
 uint32_t Topic::getConsumerHeadFile(Txn& txn, const std::string& name, uint32_t searchFrom) {
     uint64_t head = getConsumerHead(txn, name);
 
@@ -162,10 +292,239 @@ void Topic::setConsumerHead(Txn& txn, const std::string& name, uint64_t head) {
     mdb_put(txn.getEnvTxn(), _desc, &key, &val, 0);
 }
 
+vector<GroupLease> Topic::getLeases(Txn& txn, const string& group) {
+    vector<GroupLease> ret;
+
+    string first = leaseKey(group, 0);
+    size_t prefixLen = first.size() - sizeof(uint64_t);
+    MDB_val key{ first.size(), (void*)first.data() };
+
+    MDBCursor cur(_desc, txn.getEnvTxn());
+    for (int rc = cur.gte(key); rc == 0 && cur.key().mv_size == first.size() && memcmp(cur.key().mv_data, first.data(), prefixLen) == 0; rc = cur.next()) {
+        GroupLease lease = { 0, 0, 0, 0, 0 };
+        memcpy(&lease, cur.val().mv_data, min(cur.val().mv_size, sizeof(lease)));
+        ret.push_back(lease);
+    }
+
+    return ret;
+}
+
+void Topic::setLease(Txn& txn, const string& group, const GroupLease& lease) {
+    string keyStr = leaseKey(group, lease.start);
+    MDB_val key{ keyStr.size(), (void*)keyStr.data() },
+            val{ sizeof(lease), (void*)&lease };
+
+    mdb_put(txn.getEnvTxn(), _desc, &key, &val, 0);
+}
+
+void Topic::removeLease(Txn& txn, const string& group, uint64_t start) {
+    string keyStr = leaseKey(group, start);
+    MDB_val key{ keyStr.size(), (void*)keyStr.data() };
+
+    mdb_del(txn.getEnvTxn(), _desc, &key, NULL);
+}
+
+uint32_t Topic::getChunkFile(Txn& txn, uint64_t seq) {
+    /* The chunk holding seq is the last one whose first sequence is <= seq. */
+    MDBCursor cur(_desc, txn.getEnvTxn());
+    int rc = cur.gte(uint32_t(0));
+    uint32_t ret = rc == 0 ? cur.key<uint32_t>() : 0;
+
+    while (rc == 0 && cur.key().mv_size == sizeof(uint32_t) && cur.val<uint64_t>() <= seq) {
+        ret = cur.key<uint32_t>();
+        rc = cur.next();
+    }
+
+    return ret;
+}
+
+uint64_t Topic::getChunkFirstSeq(Txn& txn, uint32_t file) {
+    MDB_val key{ sizeof(file), &file },
+            val{ 0, 0 };
+
+    if (mdb_get(txn.getEnvTxn(), _desc, &key, &val) != 0) return 0;
+    return *(uint64_t*)val.mv_data;
+}
+
+bool Topic::getChunkMeta(Txn& txn, uint32_t file, ChunkMeta& meta) {
+    MDB_val key{ sizeof(file), &file },
+            val{ 0, 0 };
+
+    if (mdb_get(txn.getEnvTxn(), _desc, &key, &val) != 0) return false;
+    meta = chunkMeta(val);
+    return true;
+}
+
+vector<pair<uint32_t, ChunkMeta>> Topic::getChunks(Txn& txn) {
+    vector<pair<uint32_t, ChunkMeta>> ret;
+
+    MDBCursor cur(_desc, txn.getEnvTxn());
+    for (int rc = cur.gte(uint32_t(0)); rc == 0 && cur.key().mv_size == sizeof(uint32_t); rc = cur.next()) {
+        ret.push_back(make_pair(cur.key<uint32_t>(), chunkMeta(cur.val())));
+    }
+
+    return ret;
+}
+
+void Topic::setChunkClosed(Txn& txn, uint32_t file, uint64_t bytes) {
+    ChunkMeta meta;
+    if (!getChunkMeta(txn, file, meta)) return;
+
+    meta.closedMs = wallClockMs();
+    meta.bytes = bytes;
+    MDB_val key{ sizeof(file), &file },
+            val{ sizeof(meta), &meta };
+
+    mdb_put(txn.getEnvTxn(), _desc, &key, &val, 0);
+}
+
+void Topic::setChunkTimes(Txn& txn, uint32_t file, uint64_t minMs, uint64_t maxMs) {
+    /* Producers of every worker write the same chunk, each only knows its own batches. */
+    ChunkMeta meta;
+    if (!getChunkMeta(txn, file, meta)) return;
+    if (meta.minMs && meta.minMs <= minMs && meta.maxMs >= maxMs) return;
+
+    meta.minMs = meta.minMs ? min(meta.minMs, minMs) : minMs;
+    meta.maxMs = max(meta.maxMs, maxMs);
+    MDB_val key{ sizeof(file), &file },
+            val{ sizeof(meta), &meta };
+
+    mdb_put(txn.getEnvTxn(), _desc, &key, &val, 0);
+}
+
+void Topic::addTimeIndex(Txn& txn, uint64_t ms, uint64_t seq) {
+    char keyBuf[timeKeySize];
+    timeKey(keyBuf, ms);
+    MDB_val key{ sizeof(keyBuf), keyBuf },
+            val{ sizeof(seq), &seq };
+
+    /* Two workers in the same millisecond: the lower sequence is the one a seek wants. */
+    mdb_put(txn.getEnvTxn(), _desc, &key, &val, MDB_NOOVERWRITE);
+}
+
+uint64_t Topic::seekTime(uint64_t ms) {
+    Txn txn(_env, NULL, true);
+    MDBCursor cur(_desc, txn.getEnvTxn());
+
+    /* The first entry at or after ms bounds the answer from above, the one before it from below. */
+    char keyBuf[timeKeySize];
+    timeKey(keyBuf, ms);
+    MDB_val key{ sizeof(keyBuf), keyBuf };
+
+    uint64_t lo = 0, hi = UINT64_MAX;
+    int rc = cur.gte(key);
+    if (rc == 0 && isTimeKey(cur.key())) hi = cur.val<uint64_t>();
+    rc = rc == 0 ? cur.prev() : cur.gotoLast();
+    if (rc == 0 && isTimeKey(cur.key())) lo = cur.val<uint64_t>();
+
+    /* Nothing indexed before ms: from the oldest chunk. */
+    rc = cur.gte(uint32_t(0));
+    if (rc == 0 && cur.key().mv_size == sizeof(uint32_t)) lo = max(lo, max(cur.val<uint64_t>(), uint64_t(1)));
+
+    uint32_t file = getChunkFile(txn, lo);
+    txn.abort();
+
+    return hi > lo ? seekChunkTime(file, lo, hi, ms) : lo;
+}
+
 int Topic::getChunkFilePath(char* buf, uint32_t chunkSeq) {
     return sprintf(buf, "%s/%s.%d", getEnv()->getRoot().c_str(), getName().c_str(), chunkSeq);
 }
 
+int Topic::getBlobFilePath(char* buf, uint32_t chunkSeq) {
+    return sprintf(buf, "%s/%s.%d.blob", getEnv()->getRoot().c_str(), getName().c_str(), chunkSeq);
+}
+
+bool Topic::statChunk(ChunkStatus& st) {
+    char path[4096];
+    getChunkFilePath(path, st.file);
+
+    struct stat fst;
+    if (stat(path, &fst) != 0) return false;
+    st.diskBytes = chunkDiskBytes(st.file);
+
+    /* The process's shared env of the chunk and a registered reader: neither writers nor the Reaper pull pages from under it. */
+    MDB_env* env = nullptr;
+    MDB_txn* txn = nullptr;
+    MDB_dbi db;
+    if (!ChunkEnvs::acquire(path, env, db)) return false;
+
+    int rc = mdb_txn_begin(env, NULL, MDB_RDONLY, &txn);
+    if (rc == 0) {
+        MDB_stat mst;
+        MDB_envinfo info;
+        mdb_stat(txn, db, &mst);
+        mdb_env_info(env, &info);
+
+        st.entries = mst.ms_entries;
+        st.pageSize = mst.ms_psize;
+        st.pagesUsed = info.me_last_pgno + 1;
+        st.mapSize = info.me_mapsize;
+
+        st.lastSeq = BatchRecord::lastSeq(txn, db);
+        /* Batch records hold many messages, entries counts messages in both formats. */
+        if (BatchRecord::format(txn, db).batched) st.entries = st.lastSeq >= st.firstSeq && st.lastSeq ? st.lastSeq - max(st.firstSeq, uint64_t(1)) + 1 : 0;
+        mdb_txn_abort(txn);
+    }
+
+    ChunkEnvs::release(path);
+    return rc == 0;
+}
+
+uint64_t Topic::chunkDiskBytes(uint32_t file) {
+    char path[4096];
+    getChunkFilePath(path, file);
+    uint64_t ret = fileDiskBytes(path);
+
+    /* The blob file lives and dies with its chunk, it counts as its disk usage. */
+    getBlobFilePath(path, file);
+    return ret + fileDiskBytes(path);
+}
+
+uint64_t Topic::seekChunkTime(uint32_t file, uint64_t lo, uint64_t hi, uint64_t ms) {
+    char path[4096];
+    getChunkFilePath(path, file);
+
+    /* The process's shared env of the chunk: a registered reader, so neither writers nor the Reaper pull pages from under the search. */
+    MDB_env* env = nullptr;
+    MDB_txn* txn = nullptr;
+    MDB_dbi db;
+    if (!ChunkEnvs::acquire(path, env, db)) return lo;
+    int rc = mdb_txn_begin(env, NULL, MDB_RDONLY, &txn);
+
+    /* Chunks without batch times only have the index, lo is never after ms. */
+    if (rc == 0 && BatchRecord::format(txn, db).timed) {
+        MDBCursor cur(db, txn);
+        while (lo < hi) {
+            /* The record holding mid is the last one keyed at or before it. */
+            uint64_t mid = lo + (hi - lo) / 2;
+            rc = cur.gte(mid);
+            if (rc != 0 || cur.key<uint64_t>() > mid) rc = rc == 0 ? cur.prev() : cur.gotoLast();
+            if (rc != 0) break;
+
+            uint64_t first = cur.key<uint64_t>(), at;
+            if (first == BatchRecord::MARKER_KEY) {
+                lo = mid + 1;
+                continue;
+            }
+            if (!BatchRecord::timeOf(cur.val(), at)) break;
+
+            uint64_t end = first + BatchRecord::count(cur.val());
+            if (at < ms) {
+                /* Past the last record of the chunk: the answer is the next chunk's first sequence. */
+                if (end <= lo) break;
+                lo = end;
+            } else {
+                hi = max(first, lo);
+            }
+        }
+    }
+
+    if (txn) mdb_txn_abort(txn);
+    ChunkEnvs::release(path);
+    return lo;
+}
+
 size_t Topic::countChunks(Txn& txn) {
     MDBCursor cur(_desc, txn.getEnvTxn());
 
@@ -181,19 +540,70 @@ size_t Topic::countChunks(Txn& txn) {
     return count;
 }
 
-void Topic::removeOldestChunk(Txn& txn) {
+bool Topic::removeOldestChunk(Txn& txn, uint32_t& file) {
     MDBCursor cur(_desc, txn.getEnvTxn());
 
     uint32_t oldest = 0;
     int rc = cur.gte(oldest);
-    if (rc == 0 && cur.key().mv_size == sizeof(oldest)) {
-        oldest = cur.key<int32_t>();
-        cur.del();
+    if (rc != 0 || cur.key().mv_size != sizeof(oldest)) return false;
+
+    file = cur.key<uint32_t>();
+    if (cur.del() != 0) return false;
+
+    /* Time index entries of the chunk, they are the oldest ones. */
+    rc = cur.gte(oldest);
+    if (rc != 0 || cur.key().mv_size != sizeof(oldest)) return true;
+    uint64_t nextFirst = cur.val<uint64_t>();
+
+    char keyBuf[timeKeySize];
+    timeKey(keyBuf, 0);
+    MDB_val key{ sizeof(keyBuf), keyBuf };
+    for (rc = cur.gte(key); rc == 0 && isTimeKey(cur.key()) && cur.val<uint64_t>() < nextFirst; rc = cur.gte(key)) {
+        if (cur.del() != 0) break;
+    }
 
-        char path[4096];
-        getChunkFilePath(path, oldest);
-        remove(path);
-        strcat(path, "-lock");
-        remove(path);
+    return true;
+}
+
+vector<uint32_t> Topic::getPartitions(Txn& txn) {
+    vector<uint32_t> ret;
+
+    MDB_val key{ strlen(keyPartitionsStr), (void*)keyPartitionsStr },
+            val{ 0, 0 };
+
+    if (mdb_get(txn.getEnvTxn(), _desc, &key, &val) == 0) {
+        const uint32_t* ids = (const uint32_t*)val.mv_data;
+        ret.assign(ids, ids + val.mv_size / sizeof(uint32_t));
     }
+
+    return ret;
+}
+
+Topic* Topic::getPartition(uint32_t id) {
+    char name[4096];
+    sprintf(name, "%s.w%u", _name.c_str(), id);
+
+    /* Opening the partition commits its own meta txn, so register it afterwards. */
+    Topic* partition = _env->getTopic(name);
+
+    {
+        Txn txn(_env, NULL, true);
+        vector<uint32_t> ids = getPartitions(txn);
+        if (find(ids.begin(), ids.end(), id) != ids.end()) return partition;
+    }
+
+    Txn txn(_env, NULL);
+    vector<uint32_t> ids = getPartitions(txn);
+    if (find(ids.begin(), ids.end(), id) == ids.end()) {
+        ids.push_back(id);
+        sort(ids.begin(), ids.end());
+
+        MDB_val key{ strlen(keyPartitionsStr), (void*)keyPartitionsStr },
+                val{ ids.size() * sizeof(uint32_t), ids.data() };
+
+        mdb_put(txn.getEnvTxn(), _desc, &key, &val, 0);
+        txn.commit();
+    }
+
+    return partition;
 }
@@ -12,24 +12,66 @@ private:
     Topic& operator=(const Topic&);
 
 public:
+    /* Moves the descriptor DBI of topic `name` from one meta env to another, if only `from` has it. */
+    static void migrate(Env* from, Env* to, const std::string& name);
+
+    void reopen(); // See Env::reopen().
     TopicStatus status();
 
     inline Env* getEnv() { return _env; }
     inline const std::string& getName() { return _name; }
 
     uint32_t getProducerHeadFile(Txn& txn);
+    /* Registers chunk `file` starting at sequence offset, created now. */
     void setProducerHeadFile(Txn& txn, uint32_t file, uint64_t offset);
 
+    /* A checkpoint, producers only write it every second and on rotation; the last key of the head chunk is authoritative. */
     uint64_t getProducerHead(Txn& txn);
     void setProducerHead(Txn& txn, uint64_t head);
+    void checkpointProducerHead(Txn& txn, uint64_t head);
 
     uint32_t getConsumerHeadFile(Txn& txn, const std::string& name, uint32_t searchFrom);
     uint64_t getConsumerHead(Txn& txn, const std::string& name);
     void setConsumerHead(Txn& txn, const std::string& name, uint64_t head);
 
+    /* Lease table of consumer group `group`, ordered by start; the group head is its consumer head. */
+    std::vector<GroupLease> getLeases(Txn& txn, const std::string& group);
+    void setLease(Txn& txn, const std::string& group, const GroupLease& lease);
+    void removeLease(Txn& txn, const std::string& group, uint64_t start);
+
+    uint32_t getChunkFile(Txn& txn, uint64_t seq);
+    uint64_t getChunkFirstSeq(Txn& txn, uint32_t file);
+    bool getChunkMeta(Txn& txn, uint32_t file, ChunkMeta& meta);
+    /* Oldest first, the last one is the head chunk. */
+    std::vector<std::pair<uint32_t, ChunkMeta>> getChunks(Txn& txn);
+    /* Records the rotation away from `file` and its final size. */
+    void setChunkClosed(Txn& txn, uint32_t file, uint64_t bytes);
+    /* Widens the chunk's time range to [minMs, maxMs]. */
+    void setChunkTimes(Txn& txn, uint32_t file, uint64_t minMs, uint64_t maxMs);
+
+    /* Sparse time index: seq is the first message of a batch committed at ms. Entries go with their chunk. */
+    void addTimeIndex(Txn& txn, uint64_t ms, uint64_t seq);
+    /*
+     * First sequence committed at or after ms: the index narrows it down to about a checkpoint
+     * interval, timed batch chunks to the batch. Past the head: the next sequence to be written.
+     */
+    uint64_t seekTime(uint64_t ms);
     int getChunkFilePath(char* buf, uint32_t chunkSeq);
+    /* Side store of the chunk's large messages, see BatchRecord. */
+    int getBlobFilePath(char* buf, uint32_t chunkSeq);
+    /* File figures of the chunk, read from its LMDB meta pages without opening it. */
+    bool statChunk(ChunkStatus& st);
+    /* Binary search of the batches of chunk `file` in [lo, hi) for the first one committed at or after ms. */
+    uint64_t seekChunkTime(uint32_t file, uint64_t lo, uint64_t hi, uint64_t ms);
+    /* Chunk and blob file, as allocated on disk. */
+    uint64_t chunkDiskBytes(uint32_t file);
     size_t countChunks(Txn& txn);
-    void removeOldestChunk(Txn& txn);
+    /* Only drops the meta entry, the file goes once txn is committed (see Reaper). */
+    bool removeOldestChunk(Txn& txn, uint32_t& file);
+
+    /* Partitions are sub-topics "<name>.w<id>" with their own chunk series and heads. */
+    std::vector<uint32_t> getPartitions(Txn& txn);
+    Topic* getPartition(uint32_t id);
 
 private:
     Env *_env;
@@ -28,6 +28,7 @@ public:
     int gotoFirst() { return mdb_cursor_get(_cursor, &_key, &_val, MDB_FIRST); }
     int gotoLast() { return mdb_cursor_get(_cursor, &_key, &_val, MDB_LAST); }
     int next() { return mdb_cursor_get(_cursor, &_key, &_val, MDB_NEXT); }
+    int prev() { return mdb_cursor_get(_cursor, &_key, &_val, MDB_PREV); }
     int del() { return mdb_cursor_del(_cursor, 0); }
 
     int seek(const MDB_val& k) {
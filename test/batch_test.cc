@@ -0,0 +1,190 @@
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include <lz4.h>
+#include "../src/batch.h"
+#include "test.h"
+
+using namespace std;
+
+/* A record in the layout of batch.h: count, [time], lengths (tagged in a chunk with blobs), payloads. */
+static string pack(const vector<string>& msgs, const ChunkFormat& format, uint64_t ms = 0, const vector<bool>& blobs = vector<bool>()) {
+    char buf[64];
+    string lens, data;
+    for (size_t i = 0; i < msgs.size(); ++i) {
+        uint64_t len = msgs[i].size();
+        if (format.blobs) len = len << 1 | (i < blobs.size() && blobs[i] ? 1 : 0);
+        lens.append(buf, BatchRecord::putVarint(buf, len) - buf);
+        data += msgs[i];
+    }
+
+    string ret(buf, BatchRecord::putVarint(buf, msgs.size()) - buf);
+    if (format.timed) ret.append(buf, BatchRecord::putVarint(buf, ms) - buf);
+    if (format.codec == COMPRESSION_LZ4) {
+        string raw = lens + data, zipped(LZ4_compressBound(int(raw.size())), 0);
+        int n = LZ4_compress_default(raw.data(), &zipped[0], int(raw.size()), int(zipped.size()));
+        CHECK(n > 0);
+        ret.append(buf, BatchRecord::putVarint(buf, raw.size()) - buf);
+        ret.append(zipped.data(), n);
+        return ret;
+    }
+    return ret + lens + data;
+}
+
+static vector<string> unpack(const string& record, const ChunkFormat& format, uint64_t* ms = nullptr, vector<bool>* blobs = nullptr) {
+    MDB_val val{ record.size(), (void*)record.data() }, msg;
+    BatchRecord batch(val, format);
+    if (ms) *ms = batch.time();
+
+    vector<string> ret;
+    while (batch.next(msg)) {
+        ret.push_back(string((const char*)msg.mv_data, msg.mv_size));
+        if (blobs) blobs->push_back(batch.isBlob());
+    }
+    CHECK(batch.remaining() == 0);
+    return ret;
+}
+
+static void testVarints() {
+    uint64_t values[] = { 0, 1, 127, 128, 300, 16383, 16384, uint64_t(1) << 32, UINT64_MAX };
+    char buf[16];
+    for (uint64_t v : values) {
+        char* end = BatchRecord::putVarint(buf, v);
+        CHECK(size_t(end - buf) == BatchRecord::varintSize(v));
+
+        uint64_t back;
+        CHECK(BatchRecord::getVarint(buf, end, back) == end && back == v);
+        /* A varint cut short is an error, not a smaller value. */
+        if (end - buf > 1) CHECK(BatchRecord::getVarint(buf, end - 1, back) == nullptr);
+    }
+    CHECK(BatchRecord::varintSize(UINT64_MAX) == 10);
+}
+
+static void testPlain() {
+    ChunkFormat format{ true, COMPRESSION_NONE, false, false };
+    vector<string> msgs = { "a", "", string(200, 'x'), "last" };
+    string record = pack(msgs, format);
+
+    MDB_val val{ record.size(), (void*)record.data() };
+    CHECK(BatchRecord::count(val) == msgs.size());
+    CHECK(unpack(record, format) == msgs);
+
+    /* A record whose lengths run past its payloads stops at the last whole message. */
+    string cut = record.substr(0, record.size() - 2);
+    CHECK(unpack(cut, format).size() == 3);
+}
+
+static void testTimed() {
+    ChunkFormat format{ true, COMPRESSION_NONE, false, true };
+    vector<string> msgs = { "one", "two" };
+    uint64_t at = 1700000000123ull, ms = 0;
+    string record = pack(msgs, format, at);
+
+    CHECK(unpack(record, format, &ms) == msgs && ms == at);
+    MDB_val val{ record.size(), (void*)record.data() };
+    CHECK(BatchRecord::timeOf(val, ms) && ms == at);
+    CHECK(BatchRecord::count(val) == 2);
+}
+
+static void testBlobRefs() {
+    char buf[32];
+    uint64_t offset = uint64_t(5) << 30, len = 300000, o, l;
+    string ref(buf, BatchRecord::putBlobRef(buf, offset, len) - buf);
+    CHECK(ref.size() == BatchRecord::blobRefSize(offset, len));
+
+    MDB_val val{ ref.size(), (void*)ref.data() };
+    CHECK(BatchRecord::getBlobRef(val, o, l) && o == offset && l == len);
+    /* Trailing bytes make it malformed. */
+    string longer = ref + "x";
+    val = MDB_val{ longer.size(), (void*)longer.data() };
+    CHECK(!BatchRecord::getBlobRef(val, o, l));
+
+    /* The tagged lengths of a chunk with blobs mark which message is a reference. */
+    ChunkFormat format{ true, COMPRESSION_NONE, true, false };
+    vector<string> msgs = { "inline", ref };
+    vector<bool> blobs;
+    CHECK(unpack(pack(msgs, format, 0, { false, true }), format, nullptr, &blobs) == msgs);
+    CHECK(blobs.size() == 2 && !blobs[0] && blobs[1]);
+}
+
+static void testCompressed() {
+    vector<string> msgs;
+    for (int i = 0; i < 100; ++i) msgs.push_back("message " + to_string(i) + string(i, 'z'));
+
+    for (int timed = 0; timed < 2; ++timed) {
+        ChunkFormat format{ true, COMPRESSION_LZ4, true, timed != 0 };
+        string record = pack(msgs, format, 42, vector<bool>(msgs.size(), false));
+
+        string buf;
+        MDB_val val{ record.size(), (void*)record.data() }, plain;
+        CHECK(BatchRecord::inflate(val, format, buf, plain));
+        CHECK(unpack(string((const char*)plain.mv_data, plain.mv_size), format) == msgs);
+        CHECK(BatchRecord::count(val) == msgs.size());
+
+        uint64_t ms = 0;
+        if (timed) CHECK(BatchRecord::timeOf(val, ms) && ms == 42);
+
+        /* Corrupt payloads are reported, not returned. */
+        record[record.size() - 3] ^= 0x5a;
+        record.resize(record.size() - 1);
+        val = MDB_val{ record.size(), (void*)record.data() };
+        CHECK(!BatchRecord::inflate(val, format, buf, plain));
+    }
+
+    /* A raw size of 0: the batch did not shrink and is stored as is. */
+    ChunkFormat format{ true, COMPRESSION_LZ4, false, false };
+    ChunkFormat stored{ true, COMPRESSION_NONE, false, false };
+    string plainRecord = pack(msgs, stored);
+    char buf[16];
+    string head(buf, BatchRecord::putVarint(buf, msgs.size()) - buf);
+    string record = head + string(1, '\0') + plainRecord.substr(head.size());
+
+    string inflated;
+    MDB_val val{ record.size(), (void*)record.data() }, plain;
+    CHECK(BatchRecord::inflate(val, format, inflated, plain));
+    CHECK(string((const char*)plain.mv_data, plain.mv_size) == plainRecord);
+}
+
+static void testChunk() {
+    string dir = testDir("batch");
+    string path = dir + "/chunk";
+
+    MDB_env* env;
+    MDB_txn* txn;
+    MDB_dbi db;
+    mdb_env_create(&env);
+    CHECK(mdb_env_open(env, path.c_str(), MDB_NOSUBDIR, 0664) == 0);
+    CHECK(mdb_txn_begin(env, NULL, 0, &txn) == 0);
+    CHECK(mdb_dbi_open(txn, NULL, 0, &db) == 0);
+    mdb_set_compare(txn, db, mdbIntCmp<uint64_t>);
+
+    ChunkFormat format{ true, COMPRESSION_LZ4, true, true };
+    CHECK(BatchRecord::lastSeq(txn, db) == 0);
+    CHECK(BatchRecord::mark(txn, db, format) == 0);
+    ChunkFormat back = BatchRecord::format(txn, db);
+    CHECK(back.batched && back.codec == COMPRESSION_LZ4 && back.blobs && back.timed);
+    CHECK(BatchRecord::lastSeq(txn, db) == 0);
+
+    /* Keyed by the first sequence, the chunk's last one is key + count - 1. */
+    string record = pack({ "a", "b", "c" }, ChunkFormat{ true, COMPRESSION_NONE, true, true }, 7);
+    uint64_t seq = 10;
+    MDB_val key{ sizeof(seq), &seq }, val{ record.size(), (void*)record.data() };
+    CHECK(mdb_put(txn, db, &key, &val, MDB_APPEND) == 0);
+    CHECK(BatchRecord::lastSeq(txn, db) == 12);
+
+    mdb_txn_abort(txn);
+    mdb_env_close(env);
+}
+
+int main() {
+    testVarints();
+    testPlain();
+    testTimed();
+    testBlobRefs();
+    testCompressed();
+    testChunk();
+
+    printf("batch_test: ok\n");
+    return 0;
+}
@@ -0,0 +1,107 @@
+#include <string.h>
+#include <stdlib.h>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "../src/consumer.h"
+#include "../src/producer.h"
+#include "../src/topic.h"
+#include "test.h"
+
+using namespace std;
+
+static const uint64_t messageCount = 60000;
+
+/* Filler that LZ4 cannot shrink much, so compressed topics still span several chunks. */
+static char filler(uint64_t i, size_t j) {
+    return char('a' + ((i * 2654435761u + j * 40503u) >> 7) % 26);
+}
+
+/* Message of sequence seq: "<seq - 1>|" padded to a length that varies with seq. */
+static void fill(const string& dir, const TopicOpt& format) {
+    TopicOpt opt = format;
+    Producer producer(dir, "t", &opt);
+
+    Producer::BatchType batch;
+    for (uint64_t i = 0; i < messageCount; ++i) {
+        size_t len = 40 + i % 90;
+        Producer::ItemType item = Producer::ItemType::create(len);
+        for (size_t j = 0; j < len; ++j) item.data()[j] = filler(i, j);
+        sprintf(item.data(), "%llu|", (unsigned long long)i);
+        batch.push_back(std::move(item));
+
+        /* Batches of varying size, so chunk and batch boundaries fall anywhere. */
+        if (batch.size() == 1 + i % 257) {
+            CHECK(producer.push(batch));
+            batch.clear();
+        }
+    }
+    if (!batch.empty()) CHECK(producer.push(batch));
+}
+
+/* Pulls everything from the consumer's position, every message checked against its sequence. */
+static uint64_t readFrom(Consumer& consumer, uint64_t expect) {
+    vector<MDB_val> batch;
+    uint64_t first, n = 0;
+    while (consumer.pull(100, batch, first)) {
+        CHECK(first == expect);
+        for (size_t i = 0; i < batch.size(); ++i) {
+            const char* data = (const char*)batch[i].mv_data;
+            uint64_t seq = first + i;
+            CHECK(strtoull(data, nullptr, 10) == seq - 1);
+            CHECK(batch[i].mv_size == 40 + (seq - 1) % 90);
+            CHECK(data[batch[i].mv_size - 1] == filler(seq - 1, batch[i].mv_size - 1));
+        }
+        expect = first + batch.size();
+        n += batch.size();
+    }
+    return n;
+}
+
+static void testSeeks(const char* name, const TopicOpt& format) {
+    string dir = testDir(name);
+    fill(dir, format);
+
+    Topic* topic = EnvManager::getEnv(dir)->getTopic("t");
+    TopicStatus st = topic->status();
+    CHECK(st.producerHead == messageCount);
+    CHECK(st.chunks.size() > 3);
+
+    /* Both sides of every chunk boundary, and some positions in between. */
+    set<uint64_t> starts = { 0, 1, 2, 777, messageCount - 1, messageCount };
+    for (auto& chunk : st.chunks) {
+        if (chunk.firstSeq > 1) starts.insert(chunk.firstSeq - 1);
+        starts.insert(chunk.firstSeq);
+        starts.insert(chunk.firstSeq + 1);
+    }
+
+    for (uint64_t from : starts) {
+        Consumer consumer(topic, from);
+        uint64_t first = max(from, uint64_t(1));
+        CHECK(readFrom(consumer, first) == messageCount - first + 1);
+    }
+
+    /* seek() back and forth over chunks on one consumer. */
+    Consumer consumer(topic, uint64_t(0));
+    for (auto& chunk : st.chunks) {
+        uint64_t at = max(chunk.firstSeq, uint64_t(2)) - 1;
+        consumer.seek(at);
+        CHECK(readFrom(consumer, at) == messageCount - at + 1);
+    }
+    consumer.seek(5);
+    CHECK(readFrom(consumer, 5) == messageCount - 4);
+}
+
+int main() {
+    TopicOpt message{ 1024 * 1024, 100 };
+    TopicOpt batched{ 1024 * 1024, 100, false, 0, DURABILITY_NONE, 0, true, COMPRESSION_NONE, 0 };
+    TopicOpt compressed{ 256 * 1024, 100, false, 0, DURABILITY_NONE, 0, true, COMPRESSION_LZ4, 0 };
+
+    testSeeks("consumer_message", message);
+    testSeeks("consumer_batch", batched);
+    testSeeks("consumer_lz4", compressed);
+
+    printf("consumer_test: ok\n");
+    return 0;
+}
@@ -0,0 +1,60 @@
+#include <chrono>
+#include <thread>
+
+#include "../src/flush.h"
+#include "test.h"
+
+using namespace std;
+
+static void testBudget() {
+    const size_t kb = 1024;
+    FlushController ctl(chrono::microseconds(1000), chrono::milliseconds(200), 16 * kb, 1024 * kb);
+    CHECK(ctl.batchBytes() == 256 * kb);
+    CHECK(ctl.interval() == chrono::milliseconds(200));
+
+    /* Full batches committed under the target grow the budget by a step each... */
+    ctl.onFlush(ctl.batchBytes(), 500);
+    CHECK(ctl.batchBytes() == 320 * kb);
+    ctl.onFlush(ctl.batchBytes(), 500);
+    CHECK(ctl.batchBytes() == 384 * kb);
+
+    /* ...batches far below it don't. */
+    ctl.onFlush(100 * kb, 500);
+    CHECK(ctl.batchBytes() == 384 * kb);
+
+    /* A commit over the target halves it. */
+    ctl.onFlush(ctl.batchBytes(), 5000);
+    CHECK(ctl.batchBytes() == 192 * kb);
+
+    /* Clamped at both ends. */
+    for (int i = 0; i < 100; ++i) ctl.onFlush(ctl.batchBytes(), 500);
+    CHECK(ctl.batchBytes() == 1024 * kb);
+    for (int i = 0; i < 100; ++i) ctl.onFlush(ctl.batchBytes(), 5000);
+    CHECK(ctl.batchBytes() == 16 * kb);
+}
+
+static void testInterval() {
+    FlushController ctl(chrono::microseconds(1000), chrono::milliseconds(200), 16 * 1024, 1024 * 1024, chrono::milliseconds(2));
+
+    /* A budget's worth arriving every few milliseconds: flush about as often, never below the minimum. */
+    for (int i = 0; i < 20; ++i) {
+        this_thread::sleep_for(chrono::milliseconds(5));
+        ctl.onFlush(64 * 1024 * 1024, 500);
+    }
+    CHECK(ctl.interval() == chrono::milliseconds(2));
+
+    /* A trickle: the budget takes ages to fill, the interval stops at the maximum. */
+    for (int i = 0; i < 50; ++i) {
+        this_thread::sleep_for(chrono::milliseconds(2));
+        ctl.onFlush(1, 500);
+    }
+    CHECK(ctl.interval() == chrono::milliseconds(200));
+}
+
+int main() {
+    testBudget();
+    testInterval();
+
+    printf("flush_test: ok\n");
+    return 0;
+}
@@ -0,0 +1,72 @@
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../src/mpsc.h"
+#include "test.h"
+
+using namespace std;
+
+static void testBounds() {
+    MpscQueue<string> queue(5);
+    CHECK(queue.capacity() == 8);
+
+    for (int i = 0; i < 8; ++i) {
+        string item = to_string(i);
+        CHECK(queue.push(std::move(item)));
+    }
+
+    /* Full: the item stays with the caller. */
+    string item = "kept";
+    CHECK(!queue.push(std::move(item)));
+    CHECK(item == "kept");
+
+    for (int i = 0; i < 8; ++i) {
+        CHECK(queue.pop(item) && item == to_string(i));
+    }
+    CHECK(!queue.pop(item));
+}
+
+static void testProducers() {
+    const int producers = 8, perProducer = 200000;
+    MpscQueue<uint64_t> queue(1024);
+
+    vector<thread> threads;
+    for (int p = 0; p < producers; ++p) {
+        threads.emplace_back([&queue, p]() {
+            for (uint64_t i = 0; i < uint64_t(perProducer); ++i) {
+                uint64_t item = uint64_t(p) << 32 | i;
+                while (!queue.push(std::move(item))) this_thread::yield();
+            }
+        });
+    }
+
+    /* Every item arrives once, each producer's in the order it pushed them. */
+    vector<uint64_t> next(producers, 0);
+    uint64_t item;
+    for (int popped = 0; popped < producers * perProducer; ) {
+        if (!queue.pop(item)) {
+            this_thread::yield();
+            continue;
+        }
+
+        int p = int(item >> 32);
+        CHECK(p < producers);
+        CHECK((item & 0xffffffff) == next[p]);
+        ++next[p];
+        ++popped;
+    }
+
+    for (auto& t : threads) t.join();
+    CHECK(!queue.pop(item));
+    for (int p = 0; p < producers; ++p) CHECK(next[p] == uint64_t(perProducer));
+}
+
+int main() {
+    testBounds();
+    testProducers();
+
+    printf("mpsc_test: ok\n");
+    return 0;
+}
@@ -0,0 +1,141 @@
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../src/consumer.h"
+#include "../src/producer.h"
+#include "../src/ring.h"
+#include "../src/topic.h"
+#include "test.h"
+
+using namespace std;
+
+/* Shared with forked children, like the nginx shm zone. */
+static Ring* sharedRing(size_t size) {
+    void* mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    CHECK(mem != MAP_FAILED);
+    Ring* ring = Ring::create(mem, size);
+    CHECK(ring);
+    return ring;
+}
+
+static void put(Ring* ring, const string& msg) {
+    uint64_t pos;
+    char* dst = ring->reserve(msg.size(), pos);
+    CHECK(dst);
+    memcpy(dst, msg.data(), msg.size());
+    ring->commit(pos);
+}
+
+/* Drains until the ring is empty, false if that takes longer than timeoutMs. */
+static bool drainAll(Ring* ring, Producer* producer, int timeoutMs) {
+    chrono::steady_clock::time_point deadline = chrono::steady_clock::now() + chrono::milliseconds(timeoutMs);
+    while (ring->used()) {
+        size_t drained;
+        CHECK(ring->drain(producer, 1024, drained));
+        if (chrono::steady_clock::now() > deadline) return false;
+        if (!drained) this_thread::sleep_for(chrono::milliseconds(10));
+    }
+    return true;
+}
+
+static vector<string> readAll(const string& dir) {
+    Topic* topic = EnvManager::getEnv(dir)->getTopic("t");
+    Consumer consumer(topic, uint64_t(0));
+
+    vector<string> ret;
+    vector<MDB_val> batch;
+    uint64_t first;
+    while (consumer.pull(256, batch, first)) {
+        for (auto& msg : batch) ret.push_back(string((const char*)msg.mv_data, msg.mv_size));
+    }
+    return ret;
+}
+
+static void testDrain() {
+    string dir = testDir("ring");
+    Ring* ring = sharedRing(64 * 1024);
+    TopicOpt opt{ 64 * 1024 * 1024, 4 };
+    Producer* producer = new Producer(dir, "t", &opt);
+
+    /* A record that can never fit is refused right away. */
+    uint64_t pos;
+    CHECK(!ring->reserve(ring->capacity(), pos));
+    CHECK(ring->fullCount() == 1);
+
+    /* Many laps around the ring: records at the end of the buffer are padded over, never split. */
+    vector<string> expected;
+    for (int lap = 0; lap < 50; ++lap) {
+        for (int i = 0; i < 100; ++i) {
+            string msg = to_string(lap) + ":" + to_string(i) + string((lap * 7 + i) % 300, 'r');
+            put(ring, msg);
+            expected.push_back(msg);
+        }
+
+        /* A given up reservation is skipped. */
+        CHECK(ring->reserve(100, pos));
+        ring->discard(pos);
+
+        CHECK(drainAll(ring, producer, 1000));
+        CHECK(ring->used() == 0);
+    }
+
+    /* Filled up without a drainer, the rest is refused. */
+    while (ring->reserve(1000, pos)) ring->commit(pos);
+    CHECK(ring->fullCount() > 1);
+
+    delete producer;
+    CHECK(readAll(dir) == expected);
+}
+
+static void testStall() {
+    string dir = testDir("ring_stall");
+    Ring* ring = sharedRing(64 * 1024);
+    put(ring, "first");
+
+    /* A live producer that takes longer than the stall check: its record is waited for. */
+    pid_t slow = fork();
+    if (slow == 0) {
+        uint64_t pos;
+        char* dst = ring->reserve(4, pos);
+        this_thread::sleep_for(chrono::milliseconds(2500));
+        memcpy(dst, "slow", 4);
+        ring->commit(pos);
+        _exit(0);
+    }
+    this_thread::sleep_for(chrono::milliseconds(200));
+
+    /* A producer that exits mid-record: the record is skipped once it is found dead. */
+    pid_t dead = fork();
+    if (dead == 0) {
+        uint64_t pos;
+        ring->reserve(4, pos);
+        _exit(0);
+    }
+    CHECK(waitpid(dead, NULL, 0) == dead);
+
+    put(ring, "last");
+
+    TopicOpt opt{ 64 * 1024 * 1024, 4 };
+    Producer* producer = new Producer(dir, "t", &opt);
+    CHECK(drainAll(ring, producer, 10000));
+    CHECK(waitpid(slow, NULL, 0) == slow);
+    CHECK(ring->abandonedCount() == 1);
+    delete producer;
+
+    vector<string> got = readAll(dir);
+    CHECK(got.size() == 3 && got[0] == "first" && got[1] == "slow" && got[2] == "last");
+}
+
+int main() {
+    testDrain();
+    testStall();
+
+    printf("ring_test: ok\n");
+    return 0;
+}
@@ -0,0 +1,79 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+#include "../src/consumer.h"
+#include "../src/producer.h"
+#include "../src/topic.h"
+#include "test.h"
+
+using namespace std;
+
+static const int records = 1000;
+static const uint32_t recordSize = 3000;
+
+/* A spill file as a worker that exited left it: len32 framed records, nobody holding its lock. */
+static void writeSpill(const string& path) {
+    FILE* f = fopen(path.c_str(), "wb");
+    CHECK(f);
+    for (int i = 0; i < records; ++i) {
+        vector<char> data(recordSize, 'a' + i % 26);
+        sprintf(&data[0], "%d|", i);
+        CHECK(fwrite(&recordSize, sizeof(recordSize), 1, f) == 1);
+        CHECK(fwrite(&data[0], 1, data.size(), f) == data.size());
+    }
+    fclose(f);
+}
+
+int main() {
+    string dir = testDir("spill");
+    string spill = dir + "/t.spill.1";
+    writeSpill(spill);
+
+    /*
+     * A reader of this process holding the second chunk read-only keeps the producer from
+     * rotating into it: the replay writes what fits the first chunk, then fails.
+     */
+    char next[4096];
+    TopicOpt opt{ 1024 * 1024, 100 };
+    Topic* topic = EnvManager::getEnv(dir)->getTopic("t");
+    topic->getChunkFilePath(next, 1);
+
+    MDB_env* env;
+    MDB_dbi db;
+    CHECK(ChunkEnvs::acquireWritable(next, 0, opt.chunkSize, env, db));
+    ChunkEnvs::release(next);
+    CHECK(ChunkEnvs::acquire(next, env, db));
+
+    delete new Producer(dir, "t", &opt);
+    CHECK(access(spill.c_str(), F_OK) == 0);
+
+    Txn txn(topic->getEnv(), NULL, true);
+    uint64_t partial = topic->getProducerHead(txn);
+    txn.abort();
+    CHECK(partial > 0 && partial < uint64_t(records));
+
+    /* Once the chunk is free, the next producer replays the records that were not written. */
+    ChunkEnvs::release(next);
+    delete new Producer(dir, "t", &opt);
+    CHECK(access(spill.c_str(), F_OK) != 0);
+
+    Consumer consumer(topic, uint64_t(0));
+    vector<MDB_val> batch;
+    uint64_t first;
+    int n = 0;
+    while (consumer.pull(100, batch, first)) {
+        for (auto& msg : batch) {
+            CHECK(msg.mv_size == recordSize);
+            CHECK(atoi((const char*)msg.mv_data) == n);
+            ++n;
+        }
+    }
+    CHECK(n == records);
+
+    printf("spill_test: ok\n");
+    return 0;
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+
+/* A failed check prints where and ends the test with a non-zero status. */
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        exit(1); \
+    } \
+} while (0)
+
+/* Empty directory for the envs of a test, wiped at every run. */
+inline std::string testDir(const char* name) {
+    std::string dir = std::string("/tmp/lmdb_queue_test.") + name;
+    std::string cmd = "rm -rf " + dir + " && mkdir -p " + dir;
+    CHECK(system(cmd.c_str()) == 0);
+    return dir;
+}
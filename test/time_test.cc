@@ -0,0 +1,82 @@
+#include <string.h>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../src/producer.h"
+#include "../src/topic.h"
+#include "test.h"
+
+using namespace std;
+
+/* A push of a batch, and the wall clock time before it started: every earlier batch committed before. */
+struct Pushed {
+    uint64_t firstSeq;
+    uint64_t startMs;
+};
+
+static vector<Pushed> fill(const string& dir, const TopicOpt& format, uint64_t& head) {
+    TopicOpt opt = format;
+    Producer producer(dir, "t", &opt);
+
+    vector<Pushed> ret;
+    head = 0;
+    for (int k = 0; k < 150; ++k) {
+        /* Commit times only have millisecond resolution, batches must not share one. */
+        this_thread::sleep_for(chrono::milliseconds(3));
+
+        Producer::BatchType batch;
+        for (int i = 0; i < 100; ++i) {
+            Producer::ItemType item = Producer::ItemType::create(60);
+            memset(item.data(), 'a' + (k + i) % 26, 60);
+            batch.push_back(std::move(item));
+        }
+
+        Pushed pushed{ head + 1, wallClockMs() };
+        CHECK(producer.push(batch));
+        head += 100;
+        ret.push_back(pushed);
+    }
+    return ret;
+}
+
+static void testTimed() {
+    string dir = testDir("time_batch");
+    TopicOpt opt{ 256 * 1024, 100, false, 0, DURABILITY_NONE, 0, true, COMPRESSION_NONE, 0 };
+    uint64_t head;
+    vector<Pushed> pushes = fill(dir, opt, head);
+
+    Topic* topic = EnvManager::getEnv(dir)->getTopic("t");
+    CHECK(topic->status().chunks.size() > 3);
+
+    /* Timed batch chunks resolve to the batch, whichever chunk it is in. */
+    for (auto& pushed : pushes) {
+        CHECK(topic->seekTime(pushed.startMs) == pushed.firstSeq);
+    }
+    CHECK(topic->seekTime(0) == 1);
+    CHECK(topic->seekTime(wallClockMs() + 1000) == head + 1);
+}
+
+static void testIndexed() {
+    string dir = testDir("time_message");
+    TopicOpt opt{ 256 * 1024, 100 };
+    uint64_t head;
+    vector<Pushed> pushes = fill(dir, opt, head);
+
+    /* Chunks without batch times only have the sparse index: never past the answer. */
+    Topic* topic = EnvManager::getEnv(dir)->getTopic("t");
+    for (auto& pushed : pushes) {
+        uint64_t seq = topic->seekTime(pushed.startMs);
+        CHECK(seq >= 1 && seq <= pushed.firstSeq);
+    }
+    CHECK(topic->seekTime(wallClockMs() + 1000) <= head + 1);
+}
+
+int main() {
+    testTimed();
+    testIndexed();
+
+    printf("time_test: ok\n");
+    return 0;
+}